@@ -0,0 +1,465 @@
+/*************************************************************************
+
+.          SPI Sniffer output stream compression
+
+This is shared by the Sniffer firmware (spi_sniffer_03.ino), which compresses
+the buffer it sends to the PC, by the decoder (spi_decode), which expands it
+again before decoding, and by the host-side model of the firmware
+(spi_sniffer_model.c), which measures how well it works on recorded traces.
+
+Sending over USB is when the Sniffer is deaf, so the fewer characters the
+better. Two kinds of redundancy are removed from the stream described in
+spi_sniffer_03.ino:
+
+ - During a burst the slave byte is almost always the same chip status,
+   like the 0F in "400F060F2F0F0A0F...". A run of SC_RUN_MIN or more data
+   bytes with the same slave byte is sent as
+
+     rYYxxxx...    slave data YY for all of the master data bytes xx that
+                   follow, up to the next character that is not a hex digit.
+                   A '.' that ends a run is discarded.
+
+ - The same transactions, like the 47-register burst configuration, are sent
+   over and over again. A transaction (the data between '[' and ']') of
+   between SC_CACHE_MIN and SC_CACHE_MAX bytes that is identical to one of the
+   last SC_CACHE_ENTRIES transactions remembered is sent as
+
+     hnXX.         repeat the data of the transaction remembered in slot n,
+                   whose hash ends in XX
+
+Both ends keep identical caches without exchanging any messages about them:
+a transaction is remembered in the next slot, round-robin, if it started and
+ended in the same buffer ('w') and was not itself sent as a repeat. If
+characters were lost the caches can differ. Then the expander looks for the
+slot with that hash instead, and if there isn't one it puts a '!' where the
+data would have been, as for any other lost data. Recordings from before the
+hash was added have just "hn." and are expanded without the check.
+
+The decoder records what it reads with a newline after each piece, so a
+line break can fall anywhere in a run or a repeat. The expander ignores line
+breaks there, and in the middle of a data pair, as the decoder does.
+
+The expanded output is exactly what the uncompressed firmware would have
+sent, so old recordings and old firmware continue to work.
+
+--------------------------------------------------------------------------
+*   (C) Copyright 2015, Len Shustek
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of version 3 of the GNU General Public License as
+*   published by the Free Software Foundation at http://www.gnu.org/licenses,
+*   with Additional Permissions under term 7(b) that the original copyright
+*   notice and author attibution must be preserved and under term 7(c) that
+*   modified versions be marked as different from the original.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+**************************************************************************/
+
+#ifndef SPI_COMPRESS_H
+#define SPI_COMPRESS_H
+
+#include <string.h>
+#include <stdbool.h>
+
+#define SC_RUN_MIN 3        // shortest run of equal slave bytes worth coding
+#define SC_CACHE_ENTRIES 10 // transactions remembered (max 10: one digit)
+#define SC_CACHE_MIN 2      // smallest transaction worth remembering
+#define SC_CACHE_MAX 64     // largest transaction worth remembering
+#define SC_EXPAND_MAX (SC_CACHE_MAX*4/3 + 1)  // worst-case expansion per input char
+
+#define SC_SS_SELECT 0x80   // event flags, as in the firmware
+#define SC_SS_UNSELECT 0x81
+
+//****************  the transaction cache, kept at both ends  ****************
+
+#ifdef SC_COUNT_WORK  // for the model: count what the encoder does, to estimate its cycles
+struct sc_work {
+    unsigned long chars, hashed, slots, compared, copied;
+};
+#define SC_WORK(cache, what, n) ((cache)->work.what += (n))
+#else
+#define SC_WORK(cache, what, n)
+#endif
+
+struct sc_cache {
+    unsigned char len[SC_CACHE_ENTRIES];  // 0 if the slot is unused
+    unsigned short hash[SC_CACHE_ENTRIES];
+    unsigned char master[SC_CACHE_ENTRIES][SC_CACHE_MAX];
+    unsigned char slave[SC_CACHE_ENTRIES][SC_CACHE_MAX];
+    unsigned char next;  // slot to replace next
+#ifdef SC_COUNT_WORK
+    struct sc_work work;
+#endif
+};
+
+static inline unsigned short sc_hash(const unsigned char *master, const unsigned char *slave, int len) {
+    unsigned short hash = 0x811c;
+    for (int i = 0; i < len; ++i)
+        hash = (unsigned short)(((hash << 5) | (hash >> 11)) ^ master[i] ^ (slave[i] << 8));
+    return hash;
+}
+
+static inline int sc_cache_find(struct sc_cache *cache, const unsigned char *master,
+                         const unsigned char *slave, int len, unsigned short hash) {
+    for (int slot = 0; slot < SC_CACHE_ENTRIES; ++slot) {
+        SC_WORK(cache, slots, 1);
+        if (cache->len[slot] == len && cache->hash[slot] == hash) {
+            SC_WORK(cache, compared, 2 * len);
+            if (memcmp(cache->master[slot], master, len) == 0
+                    && memcmp(cache->slave[slot], slave, len) == 0)
+                return slot;
+        }
+    }
+    return -1;
+}
+
+static inline void sc_cache_add(struct sc_cache *cache, const unsigned char *master,
+                         const unsigned char *slave, int len, unsigned short hash) {
+    int slot = cache->next;
+    SC_WORK(cache, copied, 2 * len);
+    memcpy(cache->master[slot], master, len);
+    memcpy(cache->slave[slot], slave, len);
+    cache->len[slot] = (unsigned char)len;
+    cache->hash[slot] = hash;
+    if (++cache->next >= SC_CACHE_ENTRIES) cache->next = 0;
+}
+
+//****************  the encoder, used by the firmware  ****************
+
+struct sc_encoder {
+    struct sc_cache cache;
+    void (*write)(const char *str, int len);  // where the output goes
+    unsigned int numdbytes;  // data bytes since the last newline
+    int outlen;
+    char outbuf[64];
+};
+
+static inline void sc_put(struct sc_encoder *enc, char ch) {
+    SC_WORK(&enc->cache, chars, 1);
+    enc->outbuf[enc->outlen++] = ch;
+    if (enc->outlen >= (int)sizeof(enc->outbuf)) {
+        enc->write(enc->outbuf, enc->outlen);
+        enc->outlen = 0;
+    }
+}
+
+static inline void sc_put_hex(struct sc_encoder *enc, unsigned char val) {
+    static const char hexdigits[] = "0123456789ABCDEF";
+    sc_put(enc, hexdigits[val >> 4]);
+    sc_put(enc, hexdigits[val & 0x0f]);
+}
+
+static inline void sc_put_number(struct sc_encoder *enc, char type, unsigned long val) {
+    char digits[12];
+    int i = 0;
+    do digits[i++] = (char)('0' + val % 10);
+    while ((val /= 10) != 0);
+    sc_put(enc, type);
+    while (i > 0) sc_put(enc, digits[--i]);
+    sc_put(enc, '.');
+}
+
+// encode "len" consecutive data bytes, using runs of equal slave bytes
+
+static inline void sc_encode_data(struct sc_encoder *enc, const unsigned char *master,
+                           const unsigned char *slave, int len, bool runs_ok) {
+    int i = 0;
+    while (i < len) {
+        int run = 1;
+        while (i + run < len && slave[i + run] == slave[i]) ++run;
+        if (run >= SC_RUN_MIN && runs_ok) {
+            sc_put(enc, 'r');
+            sc_put_hex(enc, slave[i]);
+            for (int j = 0; j < run; ++j) sc_put_hex(enc, master[i + j]);
+            i += run;
+            if (i < len) sc_put(enc, '.');  // more hex data follows: end the run
+        }
+        else {
+            sc_put_hex(enc, master[i]);
+            sc_put_hex(enc, slave[i]);
+            ++i;
+        }
+    }
+    enc->numdbytes += len;
+}
+
+// encode and write a whole buffer of "numevents" events
+
+static inline void sc_encode_buffer(struct sc_encoder *enc, const unsigned char *flag,
+                             const unsigned char *master, const unsigned char *slave,
+                             const unsigned long *timestamp, unsigned int numevents) {
+    unsigned int i = 0;
+    sc_put_number(enc, 'w', numevents);
+    while (i < numevents) {
+        if (flag[i] == SC_SS_SELECT) { // slave select, which also has a timestamp
+            unsigned int end;
+            sc_put_number(enc, 't', timestamp[i]);
+            sc_put(enc, '[');
+            for (end = ++i; end < numevents && flag[end] == 0; ++end) ;
+            int len = end - i;
+            if (end < numevents && flag[end] == SC_SS_UNSELECT // complete transaction
+                    && len >= SC_CACHE_MIN && len <= SC_CACHE_MAX) {
+                unsigned short hash = sc_hash(&master[i], &slave[i], len);
+                SC_WORK(&enc->cache, hashed, len);
+                int slot = sc_cache_find(&enc->cache, &master[i], &slave[i], len, hash);
+                if (slot >= 0) { // we sent this recently: just refer to it
+                    sc_put(enc, 'h');
+                    sc_put(enc, (char)('0' + slot));
+                    sc_put_hex(enc, (unsigned char)hash);
+                    sc_put(enc, '.');
+                    enc->numdbytes += len;
+                    i = end;
+                    continue;
+                }
+                sc_cache_add(&enc->cache, &master[i], &slave[i], len, hash);
+            }
+            sc_encode_data(enc, &master[i], &slave[i], len, true);
+            i = end;
+        }
+        else if (flag[i] == SC_SS_UNSELECT) {
+            sc_put(enc, ']');
+            if (enc->numdbytes > 16) { // extra LF every so often after deselect, for prettiness
+                sc_put(enc, '\r');
+                sc_put(enc, '\n');
+                enc->numdbytes = 0;
+            }
+            ++i;
+        }
+        else { // data not preceeded by a slave select in this buffer
+            unsigned int end;
+            for (end = i; end < numevents && flag[end] == 0; ++end) ;
+            // runs are only recognized at the start of the buffer, or inside [ ]
+            sc_encode_data(enc, &master[i], &slave[i], end - i, i == 0);
+            i = end;
+        }
+    }
+    if (enc->outlen > 0) {
+        enc->write(enc->outbuf, enc->outlen);
+        enc->outlen = 0;
+    }
+}
+
+//****************  the expander, used by the decoder  ****************
+
+enum sc_expand_state {
+    SC_TEXT, SC_NUMBER, SC_RUN_SLAVE, SC_RUN, SC_HISTORY
+};
+
+struct sc_expander {
+    struct sc_cache cache;
+    enum sc_expand_state state;
+    int nibbles;           // hex digits accumulated so far
+    unsigned int hexval;
+    unsigned char run_slave;
+    int history_slot;      // -1 until we have its digit
+    int history_check;     // the low byte of its hash, or -1 if not sent
+    int history_nibbles;
+    char number_type;      // 't' or 'w'
+    int number_digits;
+    bool data_allowed;     // where the firmware could send data, so r and h are codes
+    bool in_transaction, transaction_repeated;
+    int transaction_len;  // may be more than SC_CACHE_MAX, which we don't remember
+    unsigned char master[SC_CACHE_MAX], slave[SC_CACHE_MAX];
+    unsigned long runs, repeats, unknown_repeats;  // statistics
+};
+
+static inline int sc_hexval(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return -1;
+}
+
+static inline void sc_expand_record(struct sc_expander *exp, unsigned char master, unsigned char slave) {
+    if (exp->in_transaction) {
+        if (exp->transaction_len < SC_CACHE_MAX) {
+            exp->master[exp->transaction_len] = master;
+            exp->slave[exp->transaction_len] = slave;
+        }
+        ++exp->transaction_len;
+    }
+}
+
+static inline char *sc_expand_pair(char *dst, unsigned char master, unsigned char slave) {
+    static const char hexdigits[] = "0123456789ABCDEF";
+    *dst++ = hexdigits[master >> 4];
+    *dst++ = hexdigits[master & 0x0f];
+    *dst++ = hexdigits[slave >> 4];
+    *dst++ = hexdigits[slave & 0x0f];
+    return dst;
+}
+
+// expand a repeat, if we have the transaction it refers to
+
+static inline char *sc_expand_history(struct sc_expander *exp, char *dst) {
+    int slot = exp->history_slot;
+    if (exp->history_nibbles == 1) slot = -1;  // damaged
+    else if (slot >= 0 && exp->history_check >= 0
+             && (exp->cache.len[slot] == 0 || (exp->cache.hash[slot] & 0xff) != exp->history_check)) {
+        slot = -1;  // the caches differ: look for it elsewhere
+        for (int s = 0; s < SC_CACHE_ENTRIES; ++s)
+            if (exp->cache.len[s] != 0 && (exp->cache.hash[s] & 0xff) == exp->history_check) {
+                slot = s;
+                break;
+            }
+    }
+    if (slot >= 0 && exp->cache.len[slot] != 0) {
+        for (int j = 0; j < exp->cache.len[slot]; ++j)
+            dst = sc_expand_pair(dst, exp->cache.master[slot][j], exp->cache.slave[slot][j]);
+        ++exp->repeats;
+    }
+    else { // we must have missed the original: report it as lost data
+        *dst++ = '!';
+        ++exp->unknown_repeats;
+    }
+    return dst;
+}
+
+// Expand "srclen" characters into "dst", which must have room for
+// srclen*SC_EXPAND_MAX characters. The state is kept between calls,
+// so the input may be broken up anywhere. Returns the number of characters
+// put into dst, which is not terminated.
+
+static inline int sc_expand(struct sc_expander *exp, const char *src, int srclen, char *dst) {
+    char *start = dst;
+    for (int i = 0; i < srclen; ++i) {
+        char ch = src[i];
+        int nibble = sc_hexval(ch);
+        switch (exp->state) {
+        case SC_RUN_SLAVE: // rYY: the slave byte for the run
+            if (nibble >= 0) {
+                exp->hexval = (exp->hexval << 4) | nibble;
+                if (++exp->nibbles == 2) {
+                    exp->run_slave = (unsigned char)exp->hexval;
+                    exp->nibbles = 0;
+                    exp->hexval = 0;
+                    exp->state = SC_RUN;
+                }
+                continue;
+            }
+            if (ch == '\r' || ch == '\n') continue;
+            exp->state = SC_TEXT;
+            break;
+        case SC_RUN:  // ...xx: master bytes of the run
+            if (nibble >= 0) {
+                exp->hexval = (exp->hexval << 4) | nibble;
+                if (++exp->nibbles == 2) {
+                    dst = sc_expand_pair(dst, (unsigned char)exp->hexval, exp->run_slave);
+                    sc_expand_record(exp, (unsigned char)exp->hexval, exp->run_slave);
+                    exp->nibbles = 0;
+                    exp->hexval = 0;
+                }
+                continue;
+            }
+            if (ch == '\r' || ch == '\n') continue;
+            exp->state = SC_TEXT;
+            exp->nibbles = 0;
+            if (ch == '.') continue;  // the run terminator isn't passed on
+            break;
+        case SC_HISTORY: // hnXX.
+            if (ch == '\r' || ch == '\n') continue;
+            if (exp->history_slot < 0 && ch >= '0' && ch <= '9') {
+                exp->history_slot = ch - '0';
+                continue;
+            }
+            if (exp->history_slot >= 0 && nibble >= 0 && exp->history_nibbles < 2) {
+                exp->history_check = (exp->history_check < 0 ? 0 : exp->history_check << 4) | nibble;
+                ++exp->history_nibbles;
+                continue;
+            }
+            exp->state = SC_TEXT;
+            dst = sc_expand_history(exp, dst);
+            exp->transaction_repeated = true;
+            if (ch == '.') continue;
+            break;
+        case SC_NUMBER:  // tnnnn. or wnnnn.
+            if ((ch >= '0' && ch <= '9') || ch == ' ') {
+                if (ch != ' ') ++exp->number_digits;
+                *dst++ = ch;
+                continue;
+            }
+            exp->state = SC_TEXT;
+            if (ch == '.' && exp->number_type == 'w' && exp->number_digits > 0) {
+                exp->data_allowed = true;  // we may be in the middle of a transaction
+                *dst++ = ch;
+                continue;
+            }
+            break;
+        case SC_TEXT:
+            break;
+        }
+
+        // uncompressed text: pass it along, but watch what goes by
+        bool at_pair = exp->nibbles == 0;
+        if (nibble >= 0) {
+            *dst++ = ch;
+            exp->hexval = (exp->hexval << 4) | nibble;
+            if (++exp->nibbles == 4) {  // a master/slave data pair
+                sc_expand_record(exp, (unsigned char)(exp->hexval >> 8), (unsigned char)exp->hexval);
+                exp->nibbles = 0;
+                exp->hexval = 0;
+            }
+            continue;
+        }
+        if ((ch == '\r' || ch == '\n') && !at_pair) {  // a break inside a data pair
+            *dst++ = ch;
+            continue;
+        }
+        exp->nibbles = 0;
+        exp->hexval = 0;
+        switch (ch) {
+        case 'r':
+            if (!exp->data_allowed || !at_pair) goto other;
+            exp->state = SC_RUN_SLAVE;
+            ++exp->runs;
+            break;
+        case 'h':
+            if (!exp->data_allowed || !at_pair) goto other;
+            exp->state = SC_HISTORY;
+            exp->history_slot = -1;
+            exp->history_check = -1;
+            exp->history_nibbles = 0;
+            break;
+        case 't':
+        case 'w':
+            exp->state = SC_NUMBER;
+            exp->number_type = ch;
+            exp->number_digits = 0;
+            if (ch == 'w') { // new buffer: transactions don't continue across it
+                exp->in_transaction = false;
+                exp->data_allowed = false;
+            }
+            *dst++ = ch;
+            break;
+        case '[':
+            exp->data_allowed = true;
+            exp->in_transaction = true;
+            exp->transaction_repeated = false;
+            exp->transaction_len = 0;
+            *dst++ = ch;
+            break;
+        case ']':
+            if (exp->in_transaction && !exp->transaction_repeated
+                    && exp->transaction_len >= SC_CACHE_MIN && exp->transaction_len <= SC_CACHE_MAX)
+                sc_cache_add(&exp->cache, exp->master, exp->slave, exp->transaction_len,
+                             sc_hash(exp->master, exp->slave, exp->transaction_len));
+            exp->in_transaction = false;
+            exp->data_allowed = false;
+            *dst++ = ch;
+            break;
+        case '.': case '!': case '\r': case '\n':
+            *dst++ = ch;
+            break;
+        default:  // something else, like notes typed into a recording
+other:
+            exp->data_allowed = false;
+            *dst++ = ch;
+        }
+    }
+    return (int)(dst - start);
+}
+
+#endif
@@ -21,18 +21,81 @@ on the microcontroller, which is mapped on the PC to a virtual COM port.
 For that mode, start the program like this:
 spi_decode -cn
 where "n" is the COM port number, which you can get from the Windows
-"Devices and Printers" display.
+"Devices and Printers" display. On Linux, where it also builds (see spi_posix.h),
+the port is /dev/ttyACMn.
 
 The detailed decoded output is displayed on the console, and also appended to "spi.cmds.txt".
-The packet traffic only is appended to "spi.pkts.txt".
+The packet traffic only is appended to "spi.pkts.txt". Long packets that the
+program writes or reads in several FIFO transactions are put back together, and
+packets that aren't as long as their length says are flagged "** expected n bytes".
 The raw input from the COM port is appended to "spi.dat".
 
 For offline testing, the datastream can also read from a prerecorded "spi.dat" file.
 For that, start the program like this:
 spi_decode -f
 
-This decoder is not entirely robust, and will break when it encounters situations I
-haven't yet seen. I will iterativelly fix problems as they occur.
+With the -l option we decode each transaction as soon as it has arrived instead
+of waiting for the serial port to go quiet, and show each packet immediately.
+Use it with firmware that sends each FIFO transaction as soon as it happens.
+With -f it replays the file, paced by a model of when that firmware would
+have sent each piece and USB would have delivered it, and reports how long
+after the end of each packet on the SPI bus it would have been written, and
+how many were within 10 msec.
+
+When several Sniffers have watched devices that talk to each other at the same
+time, their captures can be merged into one timeline in "spi.merged.txt":
+spi_decode -m thermostat.dat receiver.dat sensor.dat
+The clock offset and drift of each capture relative to the first are estimated
+from packets that were sent in one capture and received in another.
+
+With -b the packets, commands, and config register writes are also written as
+compact binary records to "spi.pkts.bin". Captures we only have the old text
+output of can be turned into the same records with
+spi_decode -i old.pkts.txt old.cmds.txt
+which writes both, in time order, to old.pkts.bin. Merging and comparing take
+.bin files as well as .dat files.
+
+Several Sniffers can also be watched live by one program, each on its own port:
+spi_decode -w COM5 COM7 COM8
+Each port is decoded separately into its own files, like spi_COM5.cmds.txt,
+and all their packets also go to "spi.live.txt" on a single timeline, with the
+time they arrived at the PC. spi_sniffer_model -r replays recorded captures
+through pseudo-terminals, to try this without the hardware.
+
+To see what is different between two captures of the same kind of device,
+spi_decode -d before.dat after.dat
+writes the packets, config register writes, and commands that are missing,
+inserted, or changed, and the places where the timing is different, to
+"spi.compare.txt".
+
+With -sfile the packets are classified using a file of signatures that give
+the device, message type, and where the source address is, for the kinds of
+packets we have figured out so far. Each packet in the packet file is tagged
+with its class, and the number of packets of each class is shown at the end.
+
+With -t we follow the state of the radio, and write a timeline of the states
+to "spi.radio.txt". At the end we show how long the radio spent in each state
+and on each channel, its airtime and receive duty cycle, and an estimate of
+the energy it used.
+
+With -p we show percentiles of the time between transactions, for each command
+strobe and for burst config writes, FIFO writes and reads, and register reads
+and writes, and also of the time from SRX to the packet and from STX to the next
+SRX, to help spot timing outliers. With -pfile they are added to the histograms
+in the file, so a batch run can look at a whole archive of captures at once:
+for %f in (*.dat) do spi_decode -f -parchive.hist %f
+
+Sniffer firmware with CYCLE_TIMES on times every event with the cycle counter
+of its processor. Then the times in the output are to the nanosecond, and each
+burst is followed by a line that says how long its bytes took, how far apart
+they were, and how long slave select was high before it. With -p there are
+also histograms of those, in nanoseconds.
+
+This decoder is not entirely robust, and will misinterpret situations I haven't yet
+seen. I will iterativelly fix problems as they occur. Bad data no longer stops it:
+it skips to the next place it can start again, and counts what it skipped.
+"spi_decode -x100 file" decodes the file with 100 rounds of random damage, to check
+that and to measure the speed.
 The major unsolvable issue is that the Sniffer will lose new data while it transmits
 a block of recorded data to the PC.
 
@@ -65,28 +128,86 @@ a block of recorded data to the PC.
 *    - switch to new input format, enhance error recovery
 * 28 Jun 2015, L. Shustek, V1.4
 *    - add option to control putting "receive enable" in the packet file
+* 18 Oct 2026, V1.5
+*    - expand the compressed stream from Sniffer firmware V4.2 (see spi_compress.h)
+* 18 Oct 2026, V1.6
+*    - add low latency mode, for firmware V4.3 that sends each FIFO transaction immediately
+* 18 Oct 2026, V1.7
+*    - add merging of captures from several Sniffers into one timeline
+*    - allow the input file to be named on the command line
+* 18 Oct 2026, V1.8
+*    - add classification of packets by a file of signatures
+* 18 Oct 2026, V1.9
+*    - add a model of the radio state machine, with a timeline, airtime, and energy
+* 18 Oct 2026, V2.0
+*    - keep going after bad data, and count it instead of showing all of it
+*    - add testing with randomly damaged input
+* 18 Oct 2026, V2.1
+*    - add comparing of two captures
+* 18 Oct 2026, V2.2
+*    - add histograms of the time between transactions, which can accumulate over many runs
+* 18 Oct 2026, V2.3
+*    - put together packets that take several FIFO transactions, and flag wrong lengths
+*    - keep packet data in pooled buffers instead of truncating it at 100 bytes
+* 18 Oct 2026, V2.4
+*    - add importing of old packet and command files into binary records, in parallel
+*    - add writing binary records of new decodes, and merging and comparing them
+* 18 Oct 2026, V2.5
+*    - add watching several serial ports at once, with one timeline of their packets
+*    - build on Linux too
+* 18 Oct 2026, V2.6
+*    - decode the cycle counter times of every event from Sniffer firmware V4.4
 */
 
-#define VERSION "1.4"
+#define VERSION "2.6"
 
 #define DATFILENAME "spi.dat"        // input in file mode, output in serial mode
 #define OUTFILENAME "spi.cmds.txt"   // output for detailed decodes
 #define PKTFILENAME "spi.pkts.txt"   // output for packets
+#define MRGFILENAME "spi.merged.txt" // output for merged packets from several captures
+#define RADFILENAME "spi.radio.txt"  // output for the radio state timeline
+#define CMPFILENAME "spi.compare.txt" // output for the differences between two captures
+#define BINFILENAME "spi.pkts.bin"   // output for binary records of the packets and events
+#define LIVEFILENAME "spi.live.txt"  // output for the packets of all the ports being watched
 
+#ifdef _WIN32
 #include <windows.h>
+#include <conio.h>
+#else
+#include "spi_posix.h"  // the same Windows calls, on Linux
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <time.h>
-#include <conio.h>
+#include <math.h>
+#include <limits.h>
+#include "spi_compress.h"
 typedef unsigned char byte;
 
-FILE  *outfile, *datfile, *pktfile=NULL;
+FILE  *outfile, *datfile, *pktfile=NULL, *radfile=NULL;
+FILE *pktrecfile = NULL;  // where to write binary packet records, if anywhere
 int comport = 5;
 bool fileread = false;
 bool receive_enable_packet = false;  // useful for investigating the frequency-hopping algorithm
+bool low_latency = false;
+bool merge = false;
+bool compare = false;
+bool record_events = false;      // also record strobes and config writes, for comparing
+bool track_radio = false;
+bool import = false;
+bool watch = false;              // watch several serial ports at once
+bool write_records = false;      // write binary records of the packets and events
+bool timing_histograms = false;
+int fuzz_rounds = 0;             // test with this many rounds of damaged input
+char *datfilename = DATFILENAME;
+char *sigfilename = NULL;        // packet signatures, if any
+char *histfilename = NULL;       // where the timing histograms accumulate, if anywhere
 
 HANDLE handle_serial = INVALID_HANDLE_VALUE;
 DCB dcbSerialParams = {
@@ -95,18 +216,94 @@ COMMTIMEOUTS timeouts = {
     0};
 
 
-#define MAX_PKT 100
+#define MAX_PKT_LENGTH 65535  // the most a packet record can hold
 struct {
     unsigned long delta_time_usec;
+    unsigned long long end_usec;  // when the last FIFO transaction of it ended
     bool xmit;
-    byte length;
-    byte data[MAX_PKT];
+    unsigned length;
+    unsigned bursts;              // how many FIFO transactions it took
+    unsigned done_length;         // of the FIFO transactions that have ended
+    byte *data;                   // from the pool of packet buffers
 }
-packet;
+packet;  // while its length isn't 0 we are waiting for the rest of it
+
+/* A compact binary form of the packets, for merging captures and for archives.
+Each record is a 14-byte little-endian header followed by the data:
+   8 bytes  time in microseconds since the start of the capture
+   1 byte   record type (PKT_xxx)
+   1 byte   channel number
+   2 bytes  sync word
+   2 bytes  data length
+When comparing captures we also record command strobes and config register
+writes this way. */
+
+#define PKT_RECORD_HEADER 14
+enum pkt_type {
+    PKT_RCVD, PKT_SENT, PKT_RCV_ENABLE, PKT_RESET,
+    PKT_STROBE,  // a command strobe: the data is the command
+    PKT_CONFIG   // config register writes: the data is the first register and the values
+};
+struct pkt_record {
+    unsigned long long time_usec;
+    byte type, chan, sync1, sync0;
+    unsigned length;
+};
 
 unsigned long cmd_delta_time = 0;
+unsigned long long capture_time_usec = 0;  // since the start of the capture
+
+#define CYCLE_HZ_DEFAULT 96000000  // the Teensy 3.1, until the Sniffer says
+unsigned long cycle_hz = 0;        // the rate of the Sniffer's cycle counter, or 0 if it doesn't send cycle times
+unsigned long long capture_cycles; // since the start of the capture
+unsigned long long event_ns;       // when the latest event happened
+unsigned long long cmd_delta_ns;
+
+void packet_record(byte type);
+void event_record(byte type, const byte *data, unsigned length);
+void add_latency(unsigned long long latency);
+void replay_send(unsigned long long bus_usec);
+void replay_select(void);
+
+#define REPLAY_CHUNK 64      // USB full-speed packet size, for replaying files in low latency mode
+#define LATENCY_BUCKETS 24   // powers of 2 microseconds
+#define LATENCY_TARGET_USEC 10000
+unsigned long long chunk_arrival_usec;  // when the input we are decoding arrived
+unsigned long latency_histogram[LATENCY_BUCKETS];
+unsigned long latency_on_target;
+
+// the model of the Sniffer and USB that paces a replay in low latency mode
+#define SNIFFER_CHAR_NSEC 150      // to format and queue a character of output
+#define SNIFFER_IDLE_USEC 100000   // it sends what it has after TIMEOUT loops with no SPI activity
+#define SNIFFER_EVENTS 7000        // or when its buffer is full, as MAX_DATA in the firmware
+#define USB_FRAME_USEC 1000        // the PC asks for data once a frame; we assume the worst
+#define USB_CHAR_NSEC 800          // about 1.2 Mbytes/sec at full speed
+#define REPLAY_WAITING 256         // packets decoded from data that hasn't been sent yet
+unsigned long long data_pairs;     // decoded so far
+struct {
+    unsigned long long sent_pairs;   // at the last send
+    unsigned long selects;           // transactions since then
+    unsigned long long event_usec;   // the time of the last transaction on the bus
+    unsigned long long pc_usec;      // when the PC is done with all that was sent, on the bus clock
+    unsigned long long decode_start; // the real time we started decoding what the next send carries
+    int numwaiting;
+    struct {
+        unsigned long long end_usec;     // the end of the packet on the bus
+        unsigned long long decode_usec;  // how long after decode_start it was written
+    } waiting[REPLAY_WAITING];
+} replay;
+
+FILE *livefile = NULL;  // the packets of all the ports being watched, as they arrive
+char *live_port;        // the port whose input we are decoding
+unsigned long long live_start_usec;
 
 void packet_decode(void);
+void fatal_err(const char *err);
+void advance_cycles(unsigned long long cycles);
+void set_cycle_hz(unsigned long hz);
+void time_select(void);
+void time_byte(void);
+void time_unselect(void);
 
 
 /**************  command-line processing  *******************/
@@ -115,10 +312,28 @@ void SayUsage(char *programName){
     static char *usage[] = {
         " ",
         "Decode an SPI bytestream to "OUTFILENAME", "PKTFILENAME", and the console",
-        "Usage: spi_decode [-cn] [-f]",
-        "  -cn  inputs from COM port n (default 5) and appends to " DATFILENAME,
-        "  -f   inputs from file "DATFILENAME" instead",
+        "Usage: spi_decode [-cn] [-f] [-r] [-l] [-b] [-sfile] [-t] [-p[file]] [-xn] [file]",
+        "       spi_decode -w [-r] [-b] [-sfile] [-t] [-p[file]] port port...",
+        "       spi_decode -m [-sfile] file file...",
+        "       spi_decode -d file file",
+        "       spi_decode -i file.pkts.txt file.cmds.txt...",
+        "  -cn  inputs from COM port n (default 5) and appends to " DATFILENAME " or file",
+        "  -f   inputs from file "DATFILENAME" or file instead",
         "  -r   record 'receive enable' in the packet file",
+        "  -l   low latency: decode each transaction as soon as it arrives",
+        "       (with -f, replay the file on a model of the Sniffer and USB, and report",
+        "       the latency from the end of each packet on the SPI bus to its output)",
+        "  -b   also write the packets, commands, and config writes to " BINFILENAME,
+        "  -w   watch several ports, each into its own files, and all into " LIVEFILENAME,
+        "  -m   merge the packets of captures made at the same time into " MRGFILENAME,
+        "  -d   compare the packets, config writes, and commands of two captures into " CMPFILENAME,
+        "       (for -m and -d, a capture can also be a .bin file from -b or -i)",
+        "  -i   import the old packet and command files of a capture into one .bin file",
+        "  -sfile  classify packets using the signatures in file",
+        "  -t   follow the radio's state into " RADFILENAME ", and show airtime and energy",
+        "  -p   show percentiles of the time between transactions of each kind",
+        "  -pfile  same, adding them to the histograms in file",
+        "  -xn  test decoding " DATFILENAME " or file with n rounds of random damage",
         ""
     };
     int i=0;
@@ -127,20 +342,24 @@ void SayUsage(char *programName){
 
 int HandleOptions(int argc,char *argv[]) {
     /* returns the index of the first argument that is not an option; i.e.
-    does not start with a dash or a slash*/
+    does not start with a dash or a slash (only a dash on Linux, where file names start with one)*/
 
     int i,firstnonoption=0;
 
     /* --- The following skeleton comes from C:\lcc\lib\wizard\textmode.tpl. */
     for (i=1; i< argc;i++) {
+#ifdef _WIN32
         if (argv[i][0] == '/' || argv[i][0] == '-') {
+#else
+        if (argv[i][0] == '-') {
+#endif
             switch (toupper(argv[i][1])) {
             case 'H':
             case '?':
                 SayUsage(argv[0]);
                 exit(1);
             case 'C':
-                if (sscanf(&argv[i][2],"%d",&comport) != 1 || comport <1 || comport > 20) goto opterror;
+                if (sscanf(&argv[i][2],"%d",&comport) != 1 || comport < 0 || comport > 20) goto opterror;
                 break;
             case 'F':
                 fileread = true;
@@ -148,6 +367,38 @@ int HandleOptions(int argc,char *argv[]) {
             case 'R':
                 receive_enable_packet = true;
                 break;
+            case 'L':
+                low_latency = true;
+                break;
+            case 'M':
+                merge = true;
+                break;
+            case 'D':
+                compare = true;
+                break;
+            case 'I':
+                import = true;
+                break;
+            case 'W':
+                watch = true;
+                break;
+            case 'B':
+                write_records = true;
+                break;
+            case 'S':
+                if (argv[i][2] == '\0') goto opterror;
+                sigfilename = &argv[i][2];
+                break;
+            case 'T':
+                track_radio = true;
+                break;
+            case 'P':
+                timing_histograms = true;
+                if (argv[i][2] != '\0') histfilename = &argv[i][2];
+                break;
+            case 'X':
+                if (sscanf(&argv[i][2],"%d",&fuzz_rounds) != 1 || fuzz_rounds < 0) goto opterror;
+                break;
                 /* add more  option switches here */
 opterror:
             default:
@@ -209,8 +460,10 @@ size_t strlcat(char *dst, const char *src, size_t siz) {
 
 void cleanup(void) {
     if (datfile) fclose(datfile);
+    if (pktrecfile) fclose(pktrecfile);
     if (outfile) fclose(outfile);
     if (pktfile) fclose(pktfile);
+    if (radfile) fclose(radfile);
     if (handle_serial != INVALID_HANDLE_VALUE) {
         fprintf(stderr, "\nClosing serial port...");
         if (CloseHandle(handle_serial) == 0)fprintf(stderr, "Error\n");
@@ -219,6 +472,34 @@ void cleanup(void) {
     }
 }
 
+HANDLE open_serial_port(char *dev_name) { // with the read timeouts already set up
+    HANDLE handle;
+    fprintf(stderr, "Opening serial port on %s...", dev_name);
+    handle = CreateFile(dev_name, GENERIC_READ | GENERIC_WRITE, 0, 0,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (handle == INVALID_HANDLE_VALUE) fatal_err("Failed");
+    dcbSerialParams.BaudRate = 115200;
+    dcbSerialParams.ByteSize = 8;
+    dcbSerialParams.StopBits = ONESTOPBIT;
+    dcbSerialParams.Parity = NOPARITY;
+    dcbSerialParams.DCBlength = sizeof(DCB);
+    if(SetCommState(handle, &dcbSerialParams) == 0) fatal_err("Error setting serial port parameters");
+    timeouts.WriteTotalTimeoutConstant = 50;
+    timeouts.WriteTotalTimeoutMultiplier = 10;
+    if(SetCommTimeouts(handle, &timeouts) == 0) fatal_err("Error setting serial port timeouts");
+    fprintf(stderr,"OK\n");
+    return handle;
+}
+
+unsigned long long now_usec(void) { // a monotonic clock
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER count;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&count);
+    return (count.QuadPart / frequency.QuadPart) * 1000000
+        + (count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+}
+
 void output (char *fmt, ...) {
     va_list args;
     va_start(args,fmt);
@@ -231,9 +512,13 @@ void output (char *fmt, ...) {
 
 
 #define MAX_LINE 60000
-char line[MAX_LINE]={
+char rawline[MAX_LINE];  // what we read, possibly compressed
+char line[MAX_LINE*SC_EXPAND_MAX]={  // what we decode, after expansion
     0}
 , *lineptr;
+struct sc_expander expander;
+char held_text[32];  // the start of a time, a count or a data pair that the last input ended in the middle of
+int held_len;
 DWORD bytes_read;
 int num_chars, linecnt=0;
 unsigned char master_data, slave_data;
@@ -245,6 +530,7 @@ unsigned char current_config_regs[64] = {
     0};
 unsigned char new_config_regs[64] = {
     0};
+bool config_written[64];  // otherwise a register still has its value after a reset
 
 static char *GDO_selection[64] = {
     "RX FIFO filled",
@@ -572,22 +858,57 @@ void fatal_err(const char *err) {
     exit(98);
 }
 
-void exit_msg(const char* err, byte parm) {
-    int i;
-    fprintf(stderr, "**** %s, %02X\n", err, parm);
-    output("**** %s, %02X\n", err, parm);
-    for (i=0;;++i) {
-        if (line[i] == 0) break;
-        if (lineptr == &line[i]) output (" <-- error --> ");
-        output("%c", line[i]);
-    }
-    output("\n");
-    cleanup();
-    exit(99);
+/* Bad data, usually from a noisy connection, doesn't stop us. We count each
+kind, show the first few of each and then only every 2**n-th one, and skip
+to the next place where we can start decoding again. */
+
+#define BAD_DATA_SHOWN 10  // of each kind, before we start showing only some
+enum bad_data_reason {
+    BAD_TIME, BAD_NUMEVENTS, BAD_HEX, BAD_RESET, BAD_BURST_READ, BAD_BURST_WRITE,
+    BAD_UNSELECTED, BAD_SINGLE_FIFO, BAD_REASONS
+};
+static char *bad_data_names[BAD_REASONS] = {
+    "bad time format", "bad buffer write numevents format", "bad hex data",
+    "reset with packet length not zero", "burst read of too many config registers",
+    "too much burst data", "FIFO or power table burst without chip selected",
+    "non-burst TX FIFO write"
+};
+void packet_abandon(enum bad_data_reason reason);
+unsigned long bad_data_count[BAD_REASONS];
+unsigned long long chars_skipped = 0;  // input we threw away to get back in step
+unsigned long packets_dropped = 0, sniffer_losses = 0;
+bool awaiting_select = false;  // skip data until the next chip select
+
+bool bad_data(enum bad_data_reason reason) { // count it, and say whether to show it
+    unsigned long count = ++bad_data_count[reason];
+    return count <= BAD_DATA_SHOWN || (count & (count-1)) == 0;
+}
+
+void warn_bad_data(enum bad_data_reason reason, byte parm) {
+    if (bad_data(reason)) output("**** %s, %02X\n", bad_data_names[reason], parm);
+}
+
+void show_bad_data(void) {
+    unsigned long total = 0;
+    for (int i=0; i<BAD_REASONS; ++i) total += bad_data_count[i];
+    if (total == 0 && sniffer_losses == 0) return;
+    fprintf(stderr, "\nbad data %lu times, %llu chars skipped, %lu partial packets dropped, %lu losses reported by the Sniffer\n",
+        total, chars_skipped, packets_dropped, sniffer_losses);
+    output("\nbad data %lu times, %llu chars skipped, %lu partial packets dropped, %lu losses reported by the Sniffer\n",
+        total, chars_skipped, packets_dropped, sniffer_losses);
+    for (int i=0; i<BAD_REASONS; ++i) if (bad_data_count[i]) {
+            fprintf(stderr, "  %8lu %s\n", bad_data_count[i], bad_data_names[i]);
+            output("  %8lu %s\n", bad_data_count[i], bad_data_names[i]);
+        }
 }
 
 void show_delta_time(void) {
-    if (cmd_delta_time) {
+    if (cycle_hz) {  // to the nanosecond
+        if (cmd_delta_ns) output("%3llu.%09llu ", cmd_delta_ns/1000000000, cmd_delta_ns % 1000000000);
+        else output("              ");
+        cmd_delta_ns = cmd_delta_time = 0;
+    }
+    else if (cmd_delta_time) {
         output("%3ld.%06ld ", cmd_delta_time/1000000, cmd_delta_time % 1000000);
         cmd_delta_time = 0;
     }
@@ -606,42 +927,353 @@ void show_config_reg(char *op, bool burstreg) {
     }
 }
 
+//****************** the CC1101 radio state machine ******************
+
+/* We follow the main radio state machine of the CC1101 from the command strobes,
+the MCSM0/1/2 configuration, and the FIFO traffic, the way the chip would, and
+correct it whenever the program reads MARCSTATE. The Sniffer sees MISO one
+byte late, so what we get for that read is the chip status byte and not
+MARCSTATE itself; the status byte has the state in bits 4 to 6, which is all
+we need. That gives a run-length
+timeline of the states in "spi.radio.txt", and at the end the time spent in
+each state, the airtime, the receive duty cycle, the time on each channel, and
+an estimate of the energy used. Everything is updated as we go, so the memory
+needed doesn't depend on how long the capture is.
+
+The transitions that take time (calibration, and settling of the frequency
+synthesizer) and the end of transmissions are timed from the data sheet,
+the data rate, and the packet length. We don't see when a packet is
+received, so we assume it is when the program starts reading the RX FIFO.
+
+Each capture is of one device, so the energy is that device's. When watching
+several Sniffers with -w, the energy of each device is shown together at the
+end. */
+
+#define XOSC_HZ 26000000.0    // the crystal on the boards we've seen
+#define CALIBRATE_USEC 721    // frequency synthesizer calibration
+#define SETTLE_USEC 88        // frequency synthesizer settling, from IDLE
+#define TURNAROUND_USEC 22    // RX to TX, or TX to RX
+#define SUPPLY_VOLTS 3.0
+
+enum radio_state {  // the first 8 are numbered as in the chip status byte
+    RADIO_IDLE, RADIO_RX, RADIO_TX, RADIO_FSTXON, RADIO_CALIBRATE, RADIO_SETTLING,
+    RADIO_RXFIFO_OVERFLOW, RADIO_TXFIFO_UNDERFLOW, RADIO_SLEEP, RADIO_XOFF, RADIO_WOR, RADIO_STATES
+};
+static struct {
+    char *name;
+    double current_ma;  // rough numbers from the data sheet for 915 MHz, TX at +10 dBm
+}
+radio_states [RADIO_STATES] = {
+    {"IDLE", 1.7}, {"RX", 16.0}, {"TX", 30.0}, {"FSTXON", 8.4}, {"CALIBRATE", 8.4}, {"SETTLING", 8.4},
+    {"RXOVERFLOW", 1.7}, {"TXUNDERFLOW", 1.7}, {"SLEEP", 0.0002}, {"XOFF", 0.165}, {"WOR", 0.0009}
+};
+
+struct {
+    enum radio_state state;
+    enum radio_state target;    // where CALIBRATE and SETTLING go next
+    unsigned long long since;   // when the current run started
+    unsigned long long until;   // when a timed state or transmission ends, or 0
+    byte chan;                  // the channel of the current run
+    unsigned tx_bytes;          // in the TX FIFO
+    unsigned autocals;          // for calibrating every 4th time
+    bool started;
+    unsigned long long state_usec[RADIO_STATES];
+    unsigned long long rx_usec[256], tx_usec[256];  // by channel
+    double rx_equivalent_usec;  // including the receiving done during WOR
+    unsigned long runs, packets_sent, packets_rcvd, corrections;
+    unsigned long long total_usec;  // what show_radio found
+    double energy_mj;
+}
+radio;
+
+double radio_bit_usec(void) {  // from the data rate in MDMCFG4 and MDMCFG3
+    double rate = (256 + current_config_regs[0x11]) * pow(2, current_config_regs[0x10] & 0x0f)
+        / pow(2, 28) * XOSC_HZ;
+    if (current_config_regs[0x12] & 0x08) rate /= 2;  // Manchester encoding
+    return 1e6 / rate;
+}
+
+unsigned long long radio_airtime(unsigned bytes, bool preamble) {
+    static byte preamble_bytes[8] = {2, 3, 4, 6, 8, 12, 16, 24};
+    byte sync_mode = current_config_regs[0x12] & 0x03;
+    if (preamble) bytes += preamble_bytes[(current_config_regs[0x13] >> 4) & 0x07];
+    bytes += sync_mode == 0 ? 0 : sync_mode == 3 ? 4 : 2;
+    if (current_config_regs[0x08] & 0x04) bytes += 2;  // CRC
+    return (unsigned long long)(bytes * 8 * radio_bit_usec());
+}
+
+double radio_wor_rx_fraction(void) { // how much of the time WOR spends receiving, from MCSM2
+    byte rx_time = current_config_regs[0x16] & 0x07;
+    if (rx_time == 7) return 0;
+    return 0.036058 / (1 << rx_time) / (1 << 5 * (current_config_regs[0x20] & 0x03));
+}
+
+void radio_end_run(unsigned long long now) {  // account for the current run, and add it to the timeline
+    unsigned long long usec = now - radio.since;
+    radio.state_usec[radio.state] += usec;
+    if (radio.state == RADIO_RX) {
+        radio.rx_usec[radio.chan] += usec;
+        radio.rx_equivalent_usec += usec;
+    }
+    if (radio.state == RADIO_TX) radio.tx_usec[radio.chan] += usec;
+    if (radio.state == RADIO_WOR) radio.rx_equivalent_usec += usec * radio_wor_rx_fraction();
+    if (radfile) fprintf(radfile, "%6llu.%06llu %-11s chan %02X %10.6f\n", radio.since/1000000,
+        radio.since%1000000, radio_states[radio.state].name, radio.chan, usec/1e6);
+    ++radio.runs;
+    radio.since = now;
+}
+
+void radio_enter(enum radio_state state, unsigned long long now) {
+    // start a new run if anything has changed
+    byte chan = current_config_regs[0x0A];
+    if (now < radio.since) now = radio.since;
+    if (radio.started && state == radio.state && chan == radio.chan) return;
+    if (radio.started) radio_end_run(now);
+    radio.started = true;
+    radio.state = state;
+    radio.chan = chan;
+    radio.since = now;
+}
+
+unsigned long long radio_settle(enum radio_state target, unsigned long long now) {
+    // start going to RX, TX, or FSTXON; returns how long it takes
+    bool from_idle = radio.state != RADIO_RX && radio.state != RADIO_TX && radio.state != RADIO_FSTXON;
+    byte autocal = (current_config_regs[0x18] >> 4) & 0x03;
+    radio.target = target;
+    if (from_idle && (autocal == 1 || (autocal == 3 && ++radio.autocals % 4 == 0))) {
+        radio_enter(RADIO_CALIBRATE, now);
+        return radio.until = now + CALIBRATE_USEC;
+    }
+    radio_enter(RADIO_SETTLING, now);
+    return radio.until = now + (from_idle ? SETTLE_USEC : TURNAROUND_USEC);
+}
+
+void radio_goto(enum radio_state state, unsigned long long now) {
+    // go to a state, going through CALIBRATE and SETTLING as needed
+    if (state == radio.state) return;
+    if ((radio.state == RADIO_CALIBRATE || radio.state == RADIO_SETTLING) && radio.target == state) return;
+    radio.until = 0;
+    radio.target = state;
+    if (state == RADIO_RX || state == RADIO_TX || state == RADIO_FSTXON) radio_settle(state, now);
+    else radio_enter(state, now);
+}
+
+void radio_off(byte mode, unsigned long long now) {  // after a packet, as set in MCSM1
+    static enum radio_state next[4] = {RADIO_IDLE, RADIO_FSTXON, RADIO_TX, RADIO_RX};
+    radio_goto(next[mode & 0x03], now);
+}
+
+void radio_advance(unsigned long long now) {  // do the timed transitions up to now
+    while (radio.until != 0 && radio.until <= now) {
+        unsigned long long then = radio.until;
+        radio.until = 0;
+        if (radio.state == RADIO_CALIBRATE && radio.target != RADIO_IDLE) {
+            radio_enter(RADIO_SETTLING, then);
+            radio.until = then + SETTLE_USEC;
+        }
+        else if (radio.state == RADIO_CALIBRATE || radio.state == RADIO_SETTLING) {
+            radio_enter(radio.target, then);
+            if (radio.target == RADIO_TX && radio.tx_bytes > 0)
+                radio.until = then + radio_airtime(radio.tx_bytes, true);
+        }
+        else if (radio.state == RADIO_TX) { // the end of a transmission
+            radio.tx_bytes = 0;
+            ++radio.packets_sent;
+            radio_off(current_config_regs[0x17], then);
+        }
+    }
+}
+
+void radio_strobe(byte strobe) {
+    unsigned long long now = capture_time_usec;
+    radio_advance(now);
+    if ((radio.state == RADIO_SLEEP || radio.state == RADIO_XOFF || radio.state == RADIO_WOR)
+            && strobe != 0x32 && strobe != 0x38 && strobe != 0x39)
+        radio_goto(RADIO_IDLE, now);  // chip select wakes it up
+    switch (strobe) {
+    case 0x30: // SRES
+        radio.tx_bytes = 0;
+        radio_goto(RADIO_IDLE, now);
+        break;
+    case 0x31: // SFSTXON
+        radio_goto(RADIO_FSTXON, now);
+        break;
+    case 0x32: // SXOFF
+        radio_goto(RADIO_XOFF, now);
+        break;
+    case 0x33: // SCAL
+        if (radio.state == RADIO_IDLE) {
+            radio.target = RADIO_IDLE;
+            radio_enter(RADIO_CALIBRATE, now);
+            radio.until = now + CALIBRATE_USEC;
+        }
+        break;
+    case 0x34: // SRX
+        radio_goto(RADIO_RX, now);
+        break;
+    case 0x35: // STX
+        radio_goto(RADIO_TX, now);
+        break;
+    case 0x36: // SIDLE
+        if ((radio.state == RADIO_RX || radio.state == RADIO_TX || radio.state == RADIO_FSTXON)
+                && ((current_config_regs[0x18] >> 4) & 0x03) == 2) {
+            radio.target = RADIO_IDLE;
+            radio_enter(RADIO_CALIBRATE, now);
+            radio.until = now + CALIBRATE_USEC;
+        }
+        else radio_goto(RADIO_IDLE, now);
+        break;
+    case 0x38: // SWOR
+        radio_goto(RADIO_WOR, now);
+        break;
+    case 0x39: // SPWD
+        radio.tx_bytes = 0;  // the FIFOs are lost
+        radio_goto(RADIO_SLEEP, now);
+        break;
+    case 0x3A: // SFRX
+        if (radio.state == RADIO_RXFIFO_OVERFLOW) radio_goto(RADIO_IDLE, now);
+        break;
+    case 0x3B: // SFTX
+        radio.tx_bytes = 0;
+        if (radio.state == RADIO_TXFIFO_UNDERFLOW) radio_goto(RADIO_IDLE, now);
+        break;
+    }
+}
+
+void radio_tx_fifo(unsigned bytes) {  // the program wrote a packet to the TX FIFO
+    unsigned long long now = capture_time_usec;
+    radio_advance(now);
+    radio.tx_bytes += bytes;
+    // if we are already transmitting the preamble, the rest follows now
+    if (radio.state == RADIO_TX && radio.until == 0) radio.until = now + radio_airtime(radio.tx_bytes, false);
+}
+
+void radio_rx_fifo(void) {  // the program is reading a received packet
+    unsigned long long now = capture_time_usec;
+    radio_advance(now);
+    ++radio.packets_rcvd;
+    if (radio.state == RADIO_RX) radio_off(current_config_regs[0x17] >> 2, now);
+}
+
+void radio_status(byte status) {  // the program read MARCSTATE, and we got the chip status byte
+    unsigned long long now = capture_time_usec;
+    enum radio_state state = (enum radio_state)((status >> 4) & 0x07);
+    radio_advance(now);
+    // if the chip isn't ready it was asleep or off, and reading woke it up
+    if ((status & 0x80) || state == radio.state) return;
+    ++radio.corrections;
+    radio.until = 0;
+    radio.target = state;
+    radio_enter(state, now);
+}
+
+void show_radio(void) {
+    unsigned long long total = 0;
+    double energy_mj = 0;
+    if (!track_radio || !radio.started) return;
+    radio_advance(capture_time_usec);
+    if (capture_time_usec > radio.since) radio_end_run(capture_time_usec);
+    for (int i=0; i<RADIO_STATES; ++i) total += radio.state_usec[i];
+    if (total == 0) return;
+    output("\nradio states over %llu.%06llu sec, %lu runs, %lu corrections from reading MARCSTATE:\n",
+        total/1000000, total%1000000, radio.runs, radio.corrections);
+    for (int i=0; i<RADIO_STATES; ++i) if (radio.state_usec[i]) {
+            double mj = radio.state_usec[i] / 1e6 * radio_states[i].current_ma * SUPPLY_VOLTS;
+            if (i == RADIO_WOR) mj += radio.state_usec[i] / 1e6 * radio_wor_rx_fraction()
+                    * radio_states[RADIO_RX].current_ma * SUPPLY_VOLTS;
+            energy_mj += mj;
+            output("  %-11s %14.6f sec %7.3f%% %12.3f mJ\n", radio_states[i].name,
+                radio.state_usec[i]/1e6, 100.0*radio.state_usec[i]/total, mj);
+        }
+    output("  airtime %.6f sec for %lu packets sent, %lu packets received, RX duty cycle %.3f%%\n",
+        radio.state_usec[RADIO_TX]/1e6, radio.packets_sent, radio.packets_rcvd,
+        100.0*radio.rx_equivalent_usec/total);
+    output("  estimated energy %.3f mJ, average current %.4f mA at %.1f V\n",
+        energy_mj, energy_mj / SUPPLY_VOLTS / (total/1e6), SUPPLY_VOLTS);
+    output("  channel    RX sec      TX sec\n");
+    for (int chan=0; chan<256; ++chan) if (radio.rx_usec[chan] || radio.tx_usec[chan])
+            output("       %02X %10.6f  %10.6f\n", chan, radio.rx_usec[chan]/1e6, radio.tx_usec[chan]/1e6);
+    if (!livefile) fprintf(stderr, "\nradio: %.6f sec, airtime %.6f sec, RX duty cycle %.3f%%, about %.3f mJ (see " OUTFILENAME ")\n",
+        total/1e6, radio.state_usec[RADIO_TX]/1e6, 100.0*radio.rx_equivalent_usec/total, energy_mj);
+    radio.total_usec = total;
+    radio.energy_mj = energy_mj;
+}
+
 void command_strobe(void) {
     show_delta_time();
     output("command %02X: %s (%s)\n", regnum, command_strobes[regnum-0x30].name, command_strobes[regnum-0x30].descr);
+    if (track_radio) radio_strobe(regnum);
+    event_record(PKT_STROBE, &regnum, 1);
     if (regnum == 0x30) {  // chip reset: mark in the packet stream
-        if (packet.length != 0) exit_msg("reset with packet length not zero", packet.length);
+        if (packet.length != 0) packet_abandon(BAD_RESET);  // the rest of the packet isn't coming
         // not interesting, because it happens too often:  packet_decode();
     }
     if (receive_enable_packet && regnum == 0x34) { // enable RX: create pseudo-packet entry in the log
-        fprintf(pktfile, "%3ld.%06d sec ", packet.delta_time_usec/1000000, (packet.delta_time_usec%1000000));
-        fprintf(pktfile, "rcv enable on chan %02X sync %02X %02X\n",
-            current_config_regs[0x0A], current_config_regs[0x04], current_config_regs[0x05]);
-        packet.delta_time_usec = 0;
+        packet_record(PKT_RCV_ENABLE);
+    }
+}
+
+char *resync_scan(char *ptr) {
+    /* Find the next place we can start decoding again: a chip select, or a
+    buffer or time marker with a plausible number. The library's strcspn is
+    much faster than looking at one character at a time. */
+    while (*(ptr += strcspn(ptr, "[wtkK")) != '\0') {
+        int digits = 0;
+        if (*ptr == '[') break;
+        while (isdigit((byte)ptr[1+digits]) && digits <= 10) ++digits;
+        if (digits > 0 && digits <= 10 && ptr[1+digits] == '.') break;
+        ++ptr;
+    }
+    return ptr;
+}
+
+void skip_data(void) { // skip data until the next place we can start again
+    char *start = lineptr;
+    lineptr = resync_scan(lineptr);
+    chars_skipped += lineptr - start;
+    awaiting_select = *lineptr != '[';
+}
+
+void recover_after_bad_data (enum bad_data_reason reason) {
+    char *start = lineptr;
+    bool show = bad_data(reason);
+    if (show) {
+        output ("*** %s at ", bad_data_names[reason]);
+        for (int i=0; i<32 && *(lineptr+i); ++i) output("%c",*(lineptr+i));
     }
+    skip_data();
+    if (packet.length != 0) packet_abandon(BAD_REASONS);  // what we have of this transaction is no good
+    if (show) output(", skipping %d chars%s.\n", (int)(lineptr - start),
+            bad_data_count[reason] > BAD_DATA_SHOWN ? " (only some of these are shown)" : "");
 }
 
-void recover_after_bad_data (char *msg) {
-    output ("*** %s at ", msg);
-    for (int i=0; i<32 && *(lineptr+i); ++i) output("%c",*(lineptr+i));
-    output(", skipping ");
-    // try to recover by skipping to next chip select
-    while (*lineptr && *lineptr!='[') output("%c", *(lineptr++));
-    if (*lineptr=='\0') output("<nul>");
-    output(".\n");
+bool read_time_number(unsigned long long *value) {  // the number after a t, k or K, and its '.'
+    num_chars = -1;  // sscanf doesn't set it if the '.' is missing
+    if (sscanf(++lineptr, " %llu . %n", value, &num_chars) == 1 && num_chars >= 0) {
+        lineptr += num_chars;
+        return true;
+    }
+    if (lineptr[strspn(lineptr, " 0123456789")] == '\0')
+        lineptr += strlen(lineptr);  // the input ends in the middle of it: there is nothing more to decode
+    else recover_after_bad_data(BAD_TIME);
+    return false;
 }
 
 bool skip_timestamp(void) {
-    if (*lineptr == 't') {  // time delta
-        unsigned long delta_time;
-        if (sscanf(++lineptr, " %ld . %n", &delta_time, &num_chars) != 1) {
-            recover_after_bad_data("bad time format");
-            return false;
-        }
-        else {
-            lineptr += num_chars;
+    while (*lineptr == 't' || *lineptr == 'k' || *lineptr == 'K') {
+        if (*lineptr == 't') {  // time delta
+            unsigned long long delta_time;
+            if (!read_time_number(&delta_time)) return false;
             cmd_delta_time += delta_time;
             packet.delta_time_usec += delta_time;
+            capture_time_usec += delta_time;
+        }
+        else {  // cycles since the last event, or the rate of the cycle counter
+            char kind = *lineptr;
+            unsigned long long cycles;
+            if (!read_time_number(&cycles)) return false;
+            if (kind == 'k') advance_cycles(cycles);
+            else set_cycle_hz((unsigned long)cycles);
         }
     }
     return true;
@@ -654,7 +1286,7 @@ bool skip_to_next_data(void) {
         if (*lineptr == 'w') { // buffer write marker
             int numevents;
             if (sscanf(++lineptr, " %d %n", &numevents, &num_chars) != 1) {
-                recover_after_bad_data("bad buffer write numevents format");
+                recover_after_bad_data(BAD_NUMEVENTS);
                 return false;
             }
             else {
@@ -665,10 +1297,14 @@ bool skip_to_next_data(void) {
         }
         else if (*lineptr == ']') {  // chip unselect
             chip_selected = false;
+            if (cycle_hz) time_unselect();
             ++lineptr;
         }
         else if (*lineptr == '[') {  // chip select
             chip_selected = true;
+            awaiting_select = false;
+            if (low_latency && fileread) replay_select();
+            if (cycle_hz) time_select();
             ++lineptr;
         }
         else if (*lineptr == '.') {  // number end delimeter
@@ -676,11 +1312,13 @@ bool skip_to_next_data(void) {
         }
         else if (*lineptr == '!') {
             output("*** data lost ***\n");
+            ++sniffer_losses;
             ++lineptr;
         }
         else if (*lineptr == ' ' || *lineptr == '\r' || *lineptr == '\n') {
             ++lineptr;
         }
+        else if (awaiting_select && *lineptr != '\0') skip_data();
         else break;  // must be master/slave data pair, or end of data
     }
     return true;
@@ -689,238 +1327,2884 @@ bool skip_to_next_data(void) {
 bool read_data_pair(void) {
     if (!skip_to_next_data()) return false;
     if (sscanf(lineptr, "%2hhX%2hhX %n", &master_data, &slave_data, &num_chars) != 2) {
-        recover_after_bad_data("bad hex data");
+        recover_after_bad_data(BAD_HEX);
         return false;
     }
     lineptr += num_chars;
+    ++data_pairs;
+    if (cycle_hz) time_byte();
     return true;
 }
 
+//****************** pooled packet buffers ******************
+
+/* Packet data can be any length, so it goes in buffers from a pool instead of
+a fixed array. The buffers come in sizes that are powers of 2, and each size
+has a free list. When a free list is empty we carve a new slab into buffers of
+that size, so after the first few packets no memory is allocated at all, and
+a buffer that is freed is reused by the next packet of about the same size.
+Each buffer has a small header in front that says what size it is. */
+
+#define POOL_MIN_SHIFT 4        // the smallest buffers are 16 bytes
+#define POOL_SIZES 13           // and the largest are 64K
+#define POOL_SLAB 65536         // bytes of buffers allocated at once
+
+union pool_header {  // in front of each buffer
+    union pool_header *next_free;
+    int size_index;
+    unsigned long long align;
+};
+union pool_header *pool_free_list[POOL_SIZES];
+unsigned long pool_slabs;
+
+byte *pool_alloc(unsigned size) {
+    union pool_header *buf;
+    int index = 0;
+    while ((1u << (POOL_MIN_SHIFT + index)) < size) ++index;
+    if (index >= POOL_SIZES) fatal_err("packet buffer too big");
+    if (pool_free_list[index] == NULL) {  // carve a new slab
+        size_t bufsize = sizeof(union pool_header) + (1u << (POOL_MIN_SHIFT + index));
+        size_t count = POOL_SLAB / bufsize > 0 ? POOL_SLAB / bufsize : 1;
+        char *slab;
+        if ((slab = malloc(count * bufsize)) == NULL) fatal_err("out of memory for packet buffers");
+        ++pool_slabs;
+        for (size_t i=0; i<count; ++i) {
+            buf = (union pool_header *)(slab + i * bufsize);
+            buf->next_free = pool_free_list[index];
+            pool_free_list[index] = buf;
+        }
+    }
+    buf = pool_free_list[index];
+    pool_free_list[index] = buf->next_free;
+    buf->size_index = index;
+    return (byte *)(buf + 1);
+}
+
+void pool_free(byte *data) {
+    union pool_header *buf;
+    int index;
+    if (data == NULL) return;
+    buf = (union pool_header *)data - 1;
+    index = buf->size_index;  // before it is overwritten by the link
+    buf->next_free = pool_free_list[index];
+    pool_free_list[index] = buf;
+}
+
+unsigned pool_size(const byte *data) {  // how much a buffer can hold
+    return 1u << (POOL_MIN_SHIFT + ((const union pool_header *)data - 1)->size_index);
+}
+
 //****************** packet processing ******************
 
-void packet_decode(void) {
-    fprintf(pktfile, "%3ld.%06d sec ", packet.delta_time_usec/1000000, (packet.delta_time_usec%1000000));
-    if (packet.length == 0) {  // not really a packet: a chip reset
-        fprintf(pktfile, "rset");
+unsigned long pkt_records = 0;
+
+void write_pkt_record(FILE *file, const struct pkt_record *rec, const byte *data) {
+    byte header[PKT_RECORD_HEADER];
+    for (int i=0; i<8; ++i) header[i] = (byte)(rec->time_usec >> (8*i));
+    header[8] = rec->type;
+    header[9] = rec->chan;
+    header[10] = rec->sync1;
+    header[11] = rec->sync0;
+    header[12] = (byte)rec->length;
+    header[13] = (byte)(rec->length >> 8);
+    fwrite(header, 1, PKT_RECORD_HEADER, file);
+    if (rec->length) fwrite(data, 1, rec->length, file);
+}
+
+bool read_pkt_record(FILE *file, struct pkt_record *rec, byte **data, unsigned *datasize) {
+    // returns false at the end of the file; *data is grown as needed
+    byte header[PKT_RECORD_HEADER];
+    if (fread(header, 1, PKT_RECORD_HEADER, file) != PKT_RECORD_HEADER) return false;
+    rec->time_usec = 0;
+    for (int i=7; i>=0; --i) rec->time_usec = (rec->time_usec << 8) | header[i];
+    rec->type = header[8];
+    rec->chan = header[9];
+    rec->sync1 = header[10];
+    rec->sync0 = header[11];
+    rec->length = header[12] | (header[13] << 8);
+    if (rec->length > *datasize) {
+        if ((*data = realloc(*data, rec->length)) == NULL) fatal_err("out of memory for packet data");
+        *datasize = rec->length;
     }
-    else {
-        fprintf(pktfile, "%s %2d bytes chan %02X sync %02X %02X data ",
-            packet.xmit ? "sent" : "rcvd", packet.length,
-            current_config_regs[0x0A], current_config_regs[0x04], current_config_regs[0x05]);
-        if (packet.xmit) fprintf(pktfile, "   "); // align send and received data??
-        for (int i=0; i<packet.length; ++i)
-            fprintf(pktfile, "%02X ", packet.data[i]);
+    return fread(*data, 1, rec->length, file) == rec->length;
+}
+
+void show_packet(FILE *file, const struct pkt_record *rec, const byte *data) {
+    switch (rec->type) {
+    case PKT_RESET:  // not really a packet: a chip reset
+        fprintf(file, "rset");
+        break;
+    case PKT_STROBE:
+        if (rec->length == 1 && data[0] >= 0x30 && data[0] <= 0x3f)
+            fprintf(file, "command %02X: %s", data[0], command_strobes[data[0]-0x30].name);
+        break;
+    case PKT_CONFIG:
+        if (rec->length >= 2) {
+            fprintf(file, "config %02X", data[0]);
+            if (rec->length > 2) fprintf(file, "-%02X", data[0] + rec->length - 2);
+            fprintf(file, " as ");
+            for (unsigned i=1; i<rec->length; ++i) fprintf(file, "%02X ", data[i]);
+        }
+        break;
+    case PKT_RCV_ENABLE:
+        fprintf(file, "rcv enable on chan %02X sync %02X %02X", rec->chan, rec->sync1, rec->sync0);
+        break;
+    default:
+        fprintf(file, "%s %2d bytes chan %02X sync %02X %02X data ",
+            rec->type == PKT_SENT ? "sent" : "rcvd", rec->length, rec->chan, rec->sync1, rec->sync0);
+        if (rec->type == PKT_SENT) fprintf(file, "   "); // align send and received data??
+        for (unsigned i=0; i<rec->length; ++i)
+            fprintf(file, "%02X ", data[i]);
     }
-    fprintf(pktfile, "\n");
-    packet.delta_time_usec = 0;
-    packet.length = 0;
 }
 
+//****************** packet classification ******************
 
-//***************** main loop *************************
+/* A signature file describes the packets we know about, one per line:
+   device  message  direction  length  source  pattern...
+for example
+   sensor  temp     sent       22      4:2     15 03 ?? ?? AE 36
+where
+   direction  is sent, rcvd, or any
+   length     is the number of data bytes: n, n-m, or *
+   source     is offset:count of the source address in the data, or -
+   pattern    is the first data bytes: hex, ?? for any byte, ? for any
+              hex digit, or value/mask, like 80/F0
+Everything after a # is a comment. If several signatures match a packet,
+the first one in the file wins.
 
+The signatures are compiled into a DFA that looks at the direction, then the
+length, then the data bytes, so each packet is classified with one table
+lookup per byte no matter how many signatures there are. A DFA state is the
+set of signatures that still match at that depth. States are only built when
+some packet first needs them, and if there get to be too many we start over. */
 
-int main(int argc,char *argv[]) {
-    int argno;
+#define MAX_SIGS 1024
+#define MAX_SIG_PATTERN 64
+#define MAX_SIG_NAME 24
+#define SIG_WORDS (MAX_SIGS/64)
+#define DFA_MAX_STATES 4096
+#define DFA_HASH (DFA_MAX_STATES*2)  // a power of 2
 
-    fprintf(stderr, "SPI decoder, V%s\n", VERSION);
+struct signature {
+    char device[MAX_SIG_NAME], message[MAX_SIG_NAME];
+    byte directions;          // bit (1 << pkt_type) for PKT_SENT and PKT_RCVD
+    unsigned minlen, maxlen;
+    unsigned src_offset, src_count;  // src_count is 0 if there is no source address
+    unsigned patlen;
+    byte value[MAX_SIG_PATTERN], mask[MAX_SIG_PATTERN];
+    unsigned long count;      // packets of this class
+} signatures[MAX_SIGS];
+int num_sigs = 0;
+unsigned long unclassified = 0;
 
-    argno = HandleOptions(argc,argv);
+struct dfa_state {
+    unsigned depth;           // 0: direction, 1: length, 2 on: the data bytes
+    int accept;               // the signature that matches if the packet ends here, or -1
+    bool final;               // no more input can change "accept"
+    int next[256];            // -1 until it is needed
+} dfa[DFA_MAX_STATES];
+unsigned long long dfa_sets[DFA_MAX_STATES][SIG_WORDS];
+int dfa_hash[DFA_HASH];       // state number + 1, or 0 if unused
+int dfa_states, sig_words;
+unsigned long dfa_resets;
 
-    if (fileread) {
-        if ((datfile = fopen(DATFILENAME,"r")) == NULL) // opne to read from .dat file
-            fatal_err(DATFILENAME " open for read failed");
-        fprintf(stderr, "Reading from " DATFILENAME "\n");
+void signature_error(int lineno, const char *msg, const char *token) {
+    fprintf(stderr, "%s line %d: %s: %s\n", sigfilename, lineno, msg, token ? token : "(missing)");
+    cleanup();
+    exit(98);
+}
+
+bool parse_sig_byte(const char *token, byte *value, byte *mask) {
+    // hex byte, with ? for any hex digit, or value/mask
+    int hi = sc_hexval(token[0]), lo = sc_hexval(token[1]);
+    if (token[0] == '\0' || token[1] == '\0') return false;
+    if (token[2] == '/') {
+        int mhi = sc_hexval(token[3]), mlo = sc_hexval(token[4]);
+        if (hi < 0 || lo < 0 || mhi < 0 || mlo < 0 || token[3] == '\0' || token[4] == '\0' || token[5] != '\0')
+            return false;
+        *mask = (byte)(mhi << 4 | mlo);
+        *value = (byte)(hi << 4 | lo) & *mask;
+        return true;
     }
-    else {
-        char dev_name[80];
-        sprintf(dev_name, "\\\\.\\COM%d", comport);
-        fprintf(stderr, "Opening serial port on %s...", dev_name);
-        handle_serial = CreateFile(dev_name, GENERIC_READ | GENERIC_WRITE, 0, 0,
-            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-        if (handle_serial!=INVALID_HANDLE_VALUE) {
-            dcbSerialParams.BaudRate = 115200;
-            dcbSerialParams.ByteSize = 8;
-            dcbSerialParams.StopBits = ONESTOPBIT;
-            dcbSerialParams.Parity = NOPARITY;
-            dcbSerialParams.DCBlength = sizeof(DCB);
-            if(SetCommState(handle_serial, &dcbSerialParams) == 0) fatal_err("Error setting serial port parameters");
-            timeouts.ReadIntervalTimeout =  100;  		// msec
-            timeouts.ReadTotalTimeoutConstant = 200;    // msec
-            timeouts.ReadTotalTimeoutMultiplier = 0;  // msec
-            timeouts.WriteTotalTimeoutConstant = 50;
-            timeouts.WriteTotalTimeoutMultiplier = 10;
-            if(SetCommTimeouts(handle_serial, &timeouts) == 0) fatal_err("Error setting serial port timeouts");
-            fprintf(stderr,"OK\n");
+    if (token[2] != '\0' || (hi < 0 && token[0] != '?') || (lo < 0 && token[1] != '?')) return false;
+    *mask = (hi < 0 ? 0 : 0xf0) | (lo < 0 ? 0 : 0x0f);
+    *value = (byte)((hi < 0 ? 0 : hi << 4) | (lo < 0 ? 0 : lo));
+    return true;
+}
+
+void load_signatures(void) {
+    FILE *file;
+    char buf[1000], *token, *comment;
+    int lineno = 0;
+    if ((file = fopen(sigfilename, "r")) == NULL) fatal_err("signature file open failed\n");
+    while (fgets(buf, sizeof(buf), file)) {
+        struct signature *sig = &signatures[num_sigs];
+        ++lineno;
+        if ((comment = strchr(buf, '#')) != NULL) *comment = '\0';
+        if ((token = strtok(buf, " \t\r\n")) == NULL) continue;  // blank line
+        if (num_sigs >= MAX_SIGS) signature_error(lineno, "too many signatures", token);
+        memset(sig, 0, sizeof(*sig));
+        strlcpy(sig->device, token, MAX_SIG_NAME);
+        if ((token = strtok(NULL, " \t\r\n")) == NULL) signature_error(lineno, "no message type", token);
+        strlcpy(sig->message, token, MAX_SIG_NAME);
+        token = strtok(NULL, " \t\r\n");
+        if (token && strcmp(token, "sent") == 0) sig->directions = 1 << PKT_SENT;
+        else if (token && strcmp(token, "rcvd") == 0) sig->directions = 1 << PKT_RCVD;
+        else if (token && strcmp(token, "any") == 0) sig->directions = 1 << PKT_SENT | 1 << PKT_RCVD;
+        else signature_error(lineno, "bad direction", token);
+        token = strtok(NULL, " \t\r\n");
+        if (token && strcmp(token, "*") == 0) {
+            sig->minlen = 0;
+            sig->maxlen = 255;
+        }
+        else if (token && sscanf(token, "%u-%u", &sig->minlen, &sig->maxlen) == 2) ;
+        else if (token && sscanf(token, "%u", &sig->minlen) == 1) sig->maxlen = sig->minlen;
+        else signature_error(lineno, "bad length", token);
+        if (sig->maxlen > 255) sig->maxlen = 255;  // longer packets are counted as 255
+        token = strtok(NULL, " \t\r\n");
+        if (token && strcmp(token, "-") == 0) ;
+        else if (!token || sscanf(token, "%u:%u", &sig->src_offset, &sig->src_count) != 2)
+            signature_error(lineno, "bad source address", token);
+        while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+            if (sig->patlen >= MAX_SIG_PATTERN) signature_error(lineno, "pattern too long", token);
+            if (!parse_sig_byte(token, &sig->value[sig->patlen], &sig->mask[sig->patlen]))
+                signature_error(lineno, "bad pattern byte", token);
+            ++sig->patlen;
         }
-        else fatal_err("Failed");
-        if ((datfile = fopen(DATFILENAME,"a")) == NULL) // open to append to .dat file
-            fatal_err(DATFILENAME " open for append failed");
+        ++num_sigs;
     }
+    fclose(file);
+    sig_words = (num_sigs + 63) / 64;
+    fprintf(stderr, "%d packet signatures read from %s\n", num_sigs, sigfilename);
+}
 
-    if ((outfile = fopen(OUTFILENAME,"a")) == NULL) fatal_err(OUTFILENAME " open failed");
-    if ((pktfile = fopen(PKTFILENAME,"a")) == NULL) fatal_err(PKTFILENAME " open failed");
-    fprintf(pktfile, "\n");
-
-    // atexit(cleanup);
-    fprintf(stderr, "Starting.\n");
+bool signature_matches(const struct signature *sig, unsigned depth, unsigned symbol) {
+    if (depth == 0) return (sig->directions >> symbol) & 1;
+    if (depth == 1) return symbol >= sig->minlen && symbol <= sig->maxlen;
+    depth -= 2;
+    return depth >= sig->patlen || (symbol & sig->mask[depth]) == sig->value[depth];
+}
 
-    while(!kbhit()) {
-more_data:
-        if (fileread) { // read from .dat file
-            if (!fgets(line, MAX_LINE, datfile)) {
-                output("***end of file");
-                fprintf(stderr, "***end of file");
-                cleanup();
-                exit(0);
+int dfa_find(unsigned depth, const unsigned long long *set) {
+    // the state for this depth and set of signatures, made if it doesn't exist yet
+    unsigned long long hash = 14695981039346656037ULL;  // FNV-1a
+    struct dfa_state *state;
+    unsigned i;
+    hash = (hash ^ depth) * 1099511628211ULL;
+    for (int w=0; w<sig_words; ++w) hash = (hash ^ set[w]) * 1099511628211ULL;
+    for (i = (unsigned)(hash >> 20) & (DFA_HASH-1); dfa_hash[i] != 0; i = (i+1) & (DFA_HASH-1))
+        if (dfa[dfa_hash[i]-1].depth == depth
+                && memcmp(dfa_sets[dfa_hash[i]-1], set, sig_words * sizeof(*set)) == 0)
+            return dfa_hash[i]-1;
+    state = &dfa[dfa_states];
+    memcpy(dfa_sets[dfa_states], set, sig_words * sizeof(*set));
+    state->depth = depth;
+    state->accept = -1;
+    state->final = true;
+    for (int s=0; s<num_sigs; ++s) if ((set[s/64] >> (s%64)) & 1) {
+            if (depth >= 2 && signatures[s].patlen <= depth - 2) {
+                if (state->accept < 0) state->accept = s;
             }
-            ++linecnt;
-            bytes_read = strlen(line);
-            output("got %d bytes from the file\n", bytes_read);
+            else state->final = false;
         }
-        else {  // read from serial port
-            // printf("reading serial port com%d...\n", comport);
-            ReadFile(handle_serial, line, MAX_LINE, &bytes_read, NULL);
-            line[bytes_read]='\0';
-            if (bytes_read != 0) {
-                output("got %d bytes from serial port\n", bytes_read);
-                fprintf(stderr, "got %d bytes from the serial port\n", bytes_read);
-                fprintf(datfile, "%s\n", line);
-            }
+    for (int c=0; c<256; ++c) state->next[c] = -1;
+    dfa_hash[i] = dfa_states + 1;
+    return dfa_states++;
+}
+
+void dfa_reset(void) {  // start with just the initial state
+    unsigned long long all[SIG_WORDS];
+    memset(all, 0, sizeof(all));
+    for (int s=0; s<num_sigs; ++s) all[s/64] |= 1ULL << (s%64);
+    memset(dfa_hash, 0, sizeof(dfa_hash));
+    dfa_states = 0;
+    dfa_find(0, all);
+}
+
+int dfa_next(int from, unsigned symbol) {  // build a transition
+    unsigned long long set[SIG_WORDS];
+    unsigned depth = dfa[from].depth;
+    int to;
+    memset(set, 0, sizeof(set));
+    for (int s=0; s<num_sigs; ++s)
+        if ((dfa_sets[from][s/64] >> (s%64)) & 1 && signature_matches(&signatures[s], depth, symbol))
+            set[s/64] |= 1ULL << (s%64);
+    if (dfa_states >= DFA_MAX_STATES) { // full: throw away what we have
+        dfa_reset();
+        ++dfa_resets;
+        return dfa_find(depth + 1, set);
+    }
+    to = dfa_find(depth + 1, set);
+    dfa[from].next[symbol] = to;
+    return to;
+}
+
+int classify(const struct pkt_record *rec, const byte *data) {
+    // returns the signature a packet matches, or -1
+    int state = 0;
+    if (num_sigs == 0 || (rec->type != PKT_SENT && rec->type != PKT_RCVD)) return -1;
+    if (dfa_states == 0) dfa_reset();
+    for (unsigned depth = 0; !dfa[state].final; ++depth) {
+        unsigned symbol;
+        int next;
+        if (depth >= rec->length + 2) break;  // end of the packet
+        symbol = depth == 0 ? rec->type : depth == 1 ? (rec->length > 255 ? 255 : rec->length) : data[depth-2];
+        if ((next = dfa[state].next[symbol]) < 0) next = dfa_next(state, symbol);
+        state = next;
+    }
+    return dfa[state].accept;
+}
+
+void show_class(FILE *file, const struct pkt_record *rec, const byte *data, int sig) {
+    if (num_sigs == 0 || (rec->type != PKT_SENT && rec->type != PKT_RCVD)) return;
+    if (sig < 0) {
+        fprintf(file, "= unknown");
+        return;
+    }
+    fprintf(file, "= %s %s", signatures[sig].device, signatures[sig].message);
+    if (signatures[sig].src_count > 0 && signatures[sig].src_offset + signatures[sig].src_count <= rec->length) {
+        fprintf(file, " from ");
+        for (unsigned i=0; i<signatures[sig].src_count; ++i) fprintf(file, "%02X", data[signatures[sig].src_offset + i]);
+    }
+}
+
+void show_classes(void) {
+    unsigned long total = unclassified;
+    if (num_sigs == 0) return;
+    for (int s=0; s<num_sigs; ++s) total += signatures[s].count;
+    if (total == 0) return;
+    fprintf(stderr, "\npacket classes, for %lu packets (%d DFA states, %lu restarts):\n", total, dfa_states, dfa_resets);
+    output("\npacket classes, for %lu packets:\n", total);
+    for (int s=0; s<num_sigs; ++s) if (signatures[s].count) {
+            struct signature *sig = &signatures[s];
+            char *dir = sig->directions == 1 << PKT_SENT ? "sent" : sig->directions == 1 << PKT_RCVD ? "rcvd" : "any";
+            fprintf(stderr, "  %-*s %-*s %-4s %8lu %6.2f%%\n", MAX_SIG_NAME, sig->device, MAX_SIG_NAME,
+                sig->message, dir, sig->count, 100.0*sig->count/total);
+            output("  %-*s %-*s %-4s %8lu %6.2f%%\n", MAX_SIG_NAME, sig->device, MAX_SIG_NAME,
+                sig->message, dir, sig->count, 100.0*sig->count/total);
         }
+    fprintf(stderr, "  %-*s %8lu %6.2f%%\n", 2*MAX_SIG_NAME+6, "unknown", unclassified, 100.0*unclassified/total);
+    output("  %-*s %8lu %6.2f%%\n", 2*MAX_SIG_NAME+6, "unknown", unclassified, 100.0*unclassified/total);
+}
 
-        if (strcmp(line, "SPI Sniffer\n") == 0) {
-            fprintf(stderr, "\"SPI Sniffer\" header line read\n");
-            continue;
+//****************** putting packets together ******************
+
+/* A long packet doesn't fit in the 64-byte FIFO, so the program writes or reads
+it in several FIFO transactions, and in between reads status registers like
+TXBYTES or RXBYTES to see how much room or data there is. We put those pieces
+together again. How long the packet should be comes from PKTCTRL0: in fixed
+length mode it is PKTLEN, and in variable length mode it is the first byte of
+the packet plus one. Received packets also have the two bytes of RSSI and LQI
+if PKTCTRL1 says to append them. Until we have that many bytes we wait for
+more, and the packet is written when it is complete, or when the program does
+something else. Packets that are shorter or longer than they should be are
+flagged.
+
+The Sniffer sees what the radio sends back one byte late, so each FIFO read
+we record starts with the status byte and is missing the last byte that was
+read. (Reads of status registers show the status byte too.) We keep the status
+byte at the start of a received packet, leave it out of the later reads, and
+expect one byte less for each read. */
+
+unsigned long packets_stitched, packets_short, packets_long;
+
+byte config_reg(int reg) {  // the current value, or the value after a reset
+    if (config_written[reg]) return current_config_regs[reg];
+    switch (reg) {
+    case 0x06: return 0xff;  // PKTLEN
+    case 0x07: return 0x04;  // PKTCTRL1: append status
+    case 0x08: return 0x45;  // PKTCTRL0: variable length, with CRC and whitening
+    default: return 0;
+    }
+}
+
+unsigned packet_expected_length(void) {  // of what we see, or 0 if we can't tell
+    unsigned start = packet.xmit ? 0 : 1;  // skip the status byte
+    unsigned length;
+    switch (config_reg(0x08) & 0x03) {
+    case 0: // fixed length
+        length = config_reg(0x06);
+        break;
+    case 1: // variable length: the first byte says how many follow
+        if (packet.length <= start) return 0;
+        length = 1 + packet.data[start];
+        break;
+    default: // infinite length
+        return 0;
+    }
+    if (packet.xmit) return length;
+    if (config_reg(0x07) & 0x04) length += 2;  // RSSI and LQI
+    return length > packet.bursts ? start + length - packet.bursts : start;  // the last byte of each read is missing
+}
+
+void packet_add(byte data) {
+    if (packet.length >= MAX_PKT_LENGTH) return;
+    if (packet.data == NULL || packet.length >= pool_size(packet.data)) {  // move to a bigger buffer
+        byte *bigger = pool_alloc(packet.data ? 2 * pool_size(packet.data) : 64);
+        if (packet.length) memcpy(bigger, packet.data, packet.length);
+        pool_free(packet.data);
+        packet.data = bigger;
+    }
+    packet.data[packet.length++] = data;
+}
+
+bool packet_continues(void) {  // could this transaction be part of the packet we are waiting for?
+    if (isread && isburst && regnum >= 0x30 && regnum <= 0x3d) return true;  // a status register
+    return regnum == 0x3f && isburst && (isread != 0) == !packet.xmit;  // the same FIFO
+}
+
+void packet_fifo_done(void) {  // a FIFO transaction has ended
+    unsigned expected;
+    ++packet.bursts;
+    packet.done_length = packet.length;
+    expected = packet_expected_length();
+    packet.end_usec = capture_time_usec;
+    if (expected != 0 && packet.length < expected)
+        output("  (%u of %u bytes of the packet so far)\n", packet.length, expected);
+    else packet_decode();
+    if (low_latency && fileread) replay_send(capture_time_usec);
+}
+
+void packet_flush(void) {  // write the packet we were waiting for the rest of
+    if (packet.length != 0) packet_decode();
+}
+
+/* Give up on the packet: the chip was reset, or the data went bad. The FIFO
+transactions that had ended are written as the packet, which is flagged if it
+is shorter than it should be, and only a transaction that was cut off is
+dropped. */
+
+void packet_abandon(enum bad_data_reason reason) {
+    if (packet.done_length != 0) {
+        packet.length = packet.done_length;
+        packet_decode();
+        return;
+    }
+    if (reason != BAD_REASONS) warn_bad_data(reason, packet.length);
+    ++packets_dropped;
+    packet.length = packet.bursts = 0;
+}
+
+void show_reassembly(void) {
+    if (packets_stitched + packets_short + packets_long == 0) return;
+    fprintf(stderr, "\n%lu packets were put together from several FIFO transactions, %lu were short and %lu were long\n",
+        packets_stitched, packets_short, packets_long);
+    output("\n%lu packets were put together from several FIFO transactions, %lu were short and %lu were long\n",
+        packets_stitched, packets_short, packets_long);
+}
+
+void packet_record(byte type) {  // write the current packet, or pseudo-packet
+    struct pkt_record rec;
+    int sig = -1;
+    unsigned expected = 0;
+    unsigned long late = 0;  // if we waited to see whether more of it was coming
+    if (type == PKT_SENT || type == PKT_RCVD) {
+        late = (unsigned long)(capture_time_usec - packet.end_usec);
+        expected = packet_expected_length();
+        if (packet.bursts > 1) ++packets_stitched;
+        if (expected != 0 && packet.length < expected) ++packets_short;
+        if (expected != 0 && packet.length > expected) ++packets_long;
+    }
+    rec.time_usec = capture_time_usec - late;
+    rec.type = type;
+    rec.chan = current_config_regs[0x0A];
+    rec.sync1 = current_config_regs[0x04];
+    rec.sync0 = current_config_regs[0x05];
+    rec.length = type == PKT_SENT || type == PKT_RCVD ? packet.length : 0;
+    if (num_sigs > 0 && (type == PKT_SENT || type == PKT_RCVD)) {
+        if ((sig = classify(&rec, packet.data)) >= 0) ++signatures[sig].count;
+        else ++unclassified;
+    }
+    if (pktfile) {
+        unsigned long delta_time_usec = packet.delta_time_usec - late;
+        fprintf(pktfile, "%3ld.%06d sec ", delta_time_usec/1000000, (delta_time_usec%1000000));
+        show_packet(pktfile, &rec, packet.data);
+        if (expected != 0 && packet.length != expected) fprintf(pktfile, "** expected %u bytes ", expected);
+        if (num_sigs > 0) show_class(pktfile, &rec, packet.data, sig);
+        fprintf(pktfile, "\n");
+    }
+    if (livefile) {  // when it arrived, on the clock shared by all the ports
+        fprintf(livefile, "%11.6f sec %-12s ", ((double)(chunk_arrival_usec - live_start_usec) - late) / 1e6, live_port);
+        show_packet(livefile, &rec, packet.data);
+        if (num_sigs > 0) show_class(livefile, &rec, packet.data, sig);
+        fprintf(livefile, "\n");
+    }
+    if (pktrecfile) {
+        write_pkt_record(pktrecfile, &rec, packet.data);
+        ++pkt_records;
+    }
+    packet.delta_time_usec = late;
+}
+
+void event_record(byte type, const byte *data, unsigned length) {
+    struct pkt_record rec;
+    if (!record_events || !pktrecfile) return;
+    rec.time_usec = capture_time_usec;
+    rec.type = type;
+    rec.chan = current_config_regs[0x0A];
+    rec.sync1 = current_config_regs[0x04];
+    rec.sync0 = current_config_regs[0x05];
+    rec.length = length;
+    write_pkt_record(pktrecfile, &rec, data);
+    ++pkt_records;
+}
+
+void packet_decode(void) {
+    packet_record(packet.length == 0 ? PKT_RESET : packet.xmit ? PKT_SENT : PKT_RCVD);
+    packet.length = packet.done_length = 0;
+    packet.bursts = 0;
+    if (low_latency) {
+        fflush(pktfile);
+        if (livefile) fflush(livefile);
+        if (!fileread) add_latency(now_usec() - chunk_arrival_usec);
+        else if (replay.numwaiting < REPLAY_WAITING) {  // it is written when what it was decoded from arrives
+            replay.waiting[replay.numwaiting].end_usec = packet.end_usec;
+            replay.waiting[replay.numwaiting++].decode_usec = now_usec() - replay.decode_start;
         }
-        // output("decode %n bytes: %s\n", bytes_read, line);
-        lineptr = line;
-        while (*lineptr != '\0') {
-            skip_to_next_data();  // process input up to next master/slave data pair
-            if (*lineptr == '\0')break;
-next_command:
-            if (!read_data_pair()) goto more_data;
-            isread = master_data & 0x80; 	// "read register" flag bit
-            isburst = master_data & 0x40;	// "burst" flag bit
-            regnum = master_data & 0x3f;  	// register number 0 to 63
-
-            if (isread) { //  config register read
-                if (regnum >= 0x30 && regnum <= 0x3d && !isburst) { // no, is really command strobe
-                    command_strobe();
-                }
-                else {
-                    if(isburst){
-                        if (regnum == 0x3f) { // read RX FIFO: receive packet
-                            if (!chip_selected) exit_msg("burst RX FIFO write without chip selected", regnum);
-                            show_config_reg("read", true);
-                            packet.xmit = false;
-                            while (1) { // show all burst read data from FIFO
-                                if (!skip_timestamp()) goto next_command;
-                                if (*lineptr == ']') break; // ends with chip unselect
-                                if (!read_data_pair()) goto next_command;
-                                output(" %02X", slave_data);
-                                if (packet.length < MAX_PKT)	{
-                                    packet.data[packet.length++] = slave_data;
-                                }
-                            }
-                            output("\n");
-                            packet_decode();
-                        }
-                        else  { // burst read of other than FIFO: consecutive config registers
-                            if (!skip_to_next_data()) goto next_command;
-                            while (1) {
-                                if (!skip_timestamp()) goto next_command;
-                                if (*lineptr == ']') break; // ends with chip unselect
-                                if (!read_data_pair()) goto next_command;
-                                regval = slave_data;
-                                show_config_reg("read", false);
-                                if (++regnum >= 0x40) exit_msg("burst read of too many config registers", regnum);
-                            }
-                        }
-                    }
-                    else { // regular single-register read
-                        if (!read_data_pair()) goto next_command;
-                        regval = slave_data;
-                        show_config_reg("read", false);
-                    }
-                }
-            }
-            else { // register write
-                if (regnum >= 0x30 && regnum <= 0x3d && !isburst) { // no, is really command strobe
-                    command_strobe();
-                }
-                else if (regnum == 0x3e) { // write power table
-                    if (isburst) {
-                        if (!chip_selected) exit_msg("burst power table write without chip selected", regnum);
-                        show_config_reg("write", true);
-                        while (1) { // show all burst write data to power table
-                            if (!skip_timestamp()) goto next_command;
-                            if (*lineptr == ']') break; // ends with chip unselect
-                            if (!read_data_pair()) goto next_command;
-                            output(" %02X", master_data);
-                        }
-                        output("\n");
-                    }
-                    else { // non-burst write to power table
-                        if (!read_data_pair()) goto next_command;
-                        regval = master_data;
-                        show_config_reg("write", false);
-                    }
-                }
-                else if (regnum == 0x3f) { // write TX FIFO: transmit packet
-                    if (!isburst) exit_msg("implement non-burst TX FIFO write", regnum);
-                    if (!chip_selected) exit_msg("burst TX FIFO write without chip selected", regnum);
-                    show_config_reg("write", true);
-                    packet.xmit = true;
-                    while (1) { // show all burst write data to FIFO
-                        if (!skip_timestamp()) goto next_command;
-                        if (*lineptr == ']') break; // ends with chip unselect
-                        if (!read_data_pair()) goto next_command;
-                        output(" %02X", master_data);
-                        if (packet.length < MAX_PKT) {
-                            packet.data[packet.length++] = master_data;
-                        }
-                    }
-                    output("\n");
-                    packet_decode();
-                }
-                else { // writing config register(s)
-                    if (isburst) { // burst config register write
-                        int bytes_bursted, bytes_changed, start_reg, end_reg;
-                        bytes_bursted = 0;
-                        bytes_changed = 0;
-                        start_reg = regnum;
-                        // output("burst config write\n");
-                        if (!chip_selected) output("burst write without chip selected at reg %02X", regnum);
-                        while (1) { // read all the burst write data
+    }
+}
+
+void add_latency(unsigned long long latency) {
+    int bucket = 0;
+    if (latency < LATENCY_TARGET_USEC) ++latency_on_target;
+    for ( ; latency > 0 && bucket < LATENCY_BUCKETS-1; latency >>= 1) ++bucket;
+    ++latency_histogram[bucket];
+}
+
+/* A replayed file isn't paced by the Sniffer, so we pace it on a model of
+what the Sniffer, USB, and the PC would have done, on the bus clock of the
+recording. The Sniffer sends what it has at the end of each FIFO transaction,
+or when the bus has been quiet for a while, and takes time to format it; USB
+delivers it in the next frame. The PC starts on it when it arrives, or when it
+is done with what came before, and takes as long as decoding it really took
+here. A packet is written when the PC has decoded as far as the data that
+completed it, so its latency is from the end of its last FIFO transaction on
+the bus to then. */
+
+void replay_send(unsigned long long bus_usec) {  // the Sniffer sends what it has
+    unsigned long long chars = (data_pairs - replay.sent_pairs) * 4 + replay.selects * 8;  // "t123.[" and "]" too
+    unsigned long long arrival, start, now = now_usec();
+    arrival = bus_usec + chars * SNIFFER_CHAR_NSEC / 1000 + USB_FRAME_USEC + chars * USB_CHAR_NSEC / 1000;
+    start = arrival > replay.pc_usec ? arrival : replay.pc_usec;
+    for (int i = 0; i < replay.numwaiting; ++i)
+        add_latency(start + replay.waiting[i].decode_usec - replay.waiting[i].end_usec);
+    replay.numwaiting = 0;
+    replay.pc_usec = start + (now - replay.decode_start);
+    replay.decode_start = now;
+    replay.sent_pairs = data_pairs;
+    replay.selects = 0;
+}
+
+void replay_select(void) {  // a transaction starts: has the Sniffer given up waiting, or filled up?
+    if (capture_time_usec - replay.event_usec > SNIFFER_IDLE_USEC && data_pairs != replay.sent_pairs)
+        replay_send(replay.event_usec + SNIFFER_IDLE_USEC);
+    else if (data_pairs - replay.sent_pairs + 2 * replay.selects >= SNIFFER_EVENTS)
+        replay_send(replay.event_usec);
+    replay.event_usec = capture_time_usec;
+    ++replay.selects;
+}
+
+void show_latency(void) {
+    unsigned long count = 0, sofar = 0;
+    for (int i=0; i<LATENCY_BUCKETS; ++i) count += latency_histogram[i];
+    if (count == 0) return;
+    if (fileread) fprintf(stderr, "\nmodelled latency from the end of the packet on the SPI bus to its output, "
+            "with the Sniffer sending at the end of each FIFO transaction, for %lu packets:\n", count);
+    else fprintf(stderr, "\nlatency from the end of the packet arriving on the port to its output, for %lu packets:\n", count);
+    for (int i=0; i<LATENCY_BUCKETS; ++i) if (latency_histogram[i]) {
+        sofar += latency_histogram[i];
+        if (i == 0) fprintf(stderr, "          <1 usec");
+        else if (i == LATENCY_BUCKETS-1) fprintf(stderr, " %8lu+    usec", 1UL<<(i-1));
+        else fprintf(stderr, " %8lu-%-6lu usec", 1UL<<(i-1), (1UL<<i)-1);
+        fprintf(stderr, " %8lu %6.2f%%\n", latency_histogram[i], 100.0*sofar/count);
+    }
+    fprintf(stderr, "%.2f%% within %d msec\n", 100.0*latency_on_target/count, LATENCY_TARGET_USEC/1000);
+}
+
+//****************** timing histograms ******************
+
+/* With -p we keep histograms of the time between each transaction and the one
+before it, for each kind of transaction, and also the time from an SRX command
+to the packet that is then read, and from an STX command to the next SRX.
+
+The buckets are like those of an HDR histogram: the first 32 are 1 usec wide,
+and after that each power of 2 is split into 16 buckets, so every value is
+within about 6% of its bucket's bounds. Finding the bucket takes a handful of
+shifts, whatever the value, and all the histograms together are a fixed size.
+The exact minimum and maximum are kept too.
+
+With -pfile the histograms in the file, if it exists, are added in first, and
+the totals are written back at the end, so that a batch run over many captures
+accumulates one set of histograms. */
+
+#define HIST_SUB_BITS 4                        // 16 buckets for each power of 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB)
+#define NUM_PERCENTS 4                         // that we show
+
+enum hist_kind {
+    HIST_STROBE,                    // 14 of these, one for each command strobe 0x30 to 0x3D
+    HIST_BURST_CONFIG = HIST_STROBE + 14,
+    HIST_TX_FIFO, HIST_RX_FIFO, HIST_REG_WRITE, HIST_REG_READ,
+    HIST_SRX_TO_PACKET, HIST_STX_TO_SRX,
+    HIST_BYTE_GAP_NS, HIST_SS_HIGH_NS, HIST_TRANSACTION_NS,  // from cycle times, in nsec
+    HIST_KINDS
+};
+static char *hist_names[HIST_KINDS - HIST_BURST_CONFIG] = {
+    "burst_config", "TX_FIFO", "RX_FIFO", "register_write", "register_read",
+    "SRX_to_packet", "STX_to_SRX", "byte_gap_ns", "SS_high_ns", "transaction_ns"
+};
+
+struct histogram {
+    unsigned long long count, min, max;
+    unsigned long long buckets[HIST_BUCKETS];
+} timing[HIST_KINDS];
+
+bool last_txn_known, srx_pending, stx_pending;
+unsigned long long last_txn_usec, srx_usec, stx_usec;
+
+char *hist_name(int kind) {
+    return kind < HIST_BURST_CONFIG ? command_strobes[kind].name : hist_names[kind - HIST_BURST_CONFIG];
+}
+
+int hist_bucket(unsigned long long value) {
+    int shift = 0;
+    if (value < 2*HIST_SUB) return (int)value;
+    // find the shift that leaves the top HIST_SUB_BITS+1 bits, in the same 6 steps for any value
+    for (int step = 32; step > 0; step >>= 1)
+        if (value >> (shift + step) >= HIST_SUB) shift += step;
+    return shift * HIST_SUB + (int)(value >> shift);
+}
+
+unsigned long long hist_bucket_low(int bucket) {  // the smallest value in a bucket
+    if (bucket < 2*HIST_SUB) return bucket;
+    return (unsigned long long)(bucket % HIST_SUB + HIST_SUB) << (bucket / HIST_SUB - 1);
+}
+
+unsigned long long hist_bucket_high(int bucket) {  // the largest value in a bucket
+    return bucket + 1 < HIST_BUCKETS ? hist_bucket_low(bucket + 1) - 1 : ULLONG_MAX;
+}
+
+void hist_add(enum hist_kind kind, unsigned long long value, unsigned long long count) {
+    struct histogram *h = &timing[kind];
+    if (h->count == 0 || value < h->min) h->min = value;
+    if (h->count == 0 || value > h->max) h->max = value;
+    h->buckets[hist_bucket(value)] += count;
+    h->count += count;
+}
+
+void time_transaction(void) {  // a transaction is starting: record the time since the last one
+    enum hist_kind kind;
+    unsigned long long now = capture_time_usec;
+    bool strobe = regnum >= 0x30 && regnum <= 0x3d && !isburst;
+    if (strobe) kind = HIST_STROBE + regnum - 0x30;
+    else if (regnum == 0x3f) kind = isread ? HIST_RX_FIFO : HIST_TX_FIFO;
+    else if (isread) kind = HIST_REG_READ;
+    else kind = isburst ? HIST_BURST_CONFIG : HIST_REG_WRITE;
+    if (last_txn_known) hist_add(kind, now - last_txn_usec, 1);
+    last_txn_known = true;
+    last_txn_usec = now;
+    if (kind == HIST_RX_FIFO && srx_pending) {
+        hist_add(HIST_SRX_TO_PACKET, now - srx_usec, 1);
+        srx_pending = false;
+    }
+    else if (strobe && regnum == 0x34) {  // SRX
+        if (stx_pending) hist_add(HIST_STX_TO_SRX, now - stx_usec, 1);
+        stx_pending = false;
+        srx_pending = true;
+        srx_usec = now;
+    }
+    else if (strobe && regnum == 0x35) {  // STX
+        stx_pending = true;
+        stx_usec = now;
+    }
+}
+
+/* The histogram file is text, so it can be read on any machine: for each kind
+that has any values, a line with its name, count, minimum and maximum, and then
+a line for each bucket that isn't empty with the bucket's smallest value and
+its count. */
+
+void load_histograms(void) {
+    FILE *file;
+    char name[32];
+    unsigned long long count, min, max, low;
+    int kind = -1, lineno = 0;
+    char line[100];
+    if ((file = fopen(histfilename, "r")) == NULL) return;  // we'll start it
+    while (fgets(line, sizeof(line), file)) {
+        ++lineno;
+        if (sscanf(line, "kind %31s %llu %llu %llu", name, &count, &min, &max) == 4) {
+            for (kind = 0; kind < HIST_KINDS && strcmp(name, hist_name(kind)) != 0; ++kind) ;
+            if (kind == HIST_KINDS) {
+                fprintf(stderr, "%s line %d: unknown kind %s\n", histfilename, lineno, name);
+                kind = -1;
+                continue;
+            }
+            if (count > 0) {  // so the exact bounds survive, even though the counts go in below
+                if (timing[kind].count == 0 || min < timing[kind].min) timing[kind].min = min;
+                if (timing[kind].count == 0 || max > timing[kind].max) timing[kind].max = max;
+            }
+        }
+        else if (sscanf(line, "%llu %llu", &low, &count) == 2) {
+            if (kind < 0) continue;
+            timing[kind].buckets[hist_bucket(low)] += count;
+            timing[kind].count += count;
+        }
+        else if (line[0] != '#' && line[0] != '\n')
+            fprintf(stderr, "%s line %d: not understood\n", histfilename, lineno);
+    }
+    fclose(file);
+}
+
+void save_histograms(void) {
+    FILE *file;
+    if ((file = fopen(histfilename, "w")) == NULL) {
+        fprintf(stderr, "%s open for write failed\n", histfilename);
+        return;
+    }
+    fprintf(file, "# spi_decode V%s timing histograms, in usec, or in nsec for the _ns kinds\n", VERSION);
+    for (int kind = 0; kind < HIST_KINDS; ++kind) if (timing[kind].count) {
+        fprintf(file, "kind %s %llu %llu %llu\n", hist_name(kind),
+            timing[kind].count, timing[kind].min, timing[kind].max);
+        for (int i = 0; i < HIST_BUCKETS; ++i) if (timing[kind].buckets[i])
+            fprintf(file, "%llu %llu\n", hist_bucket_low(i), timing[kind].buckets[i]);
+    }
+    fclose(file);
+}
+
+unsigned long long hist_percentile(const struct histogram *h, double percent) {
+    unsigned long long wanted = (unsigned long long)ceil(h->count * percent / 100.0), sofar = 0;
+    if (wanted == 0) wanted = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i)
+        if ((sofar += h->buckets[i]) >= wanted) {
+            unsigned long long high = hist_bucket_high(i);
+            return high < h->max ? high : h->max;  // the most it could be
+        }
+    return h->max;
+}
+
+void show_histogram_table(char *title, int first, int last) {  // for kinds first to last
+    static double percents[NUM_PERCENTS] = {50, 90, 99, 99.9};
+    bool any = false;
+    for (int kind = first; kind <= last; ++kind) if (timing[kind].count) any = true;
+    if (!any) return;
+    for (int pass = 0; pass < 2; ++pass) {  // to the console, and to the output file
+        FILE *file = pass == 0 ? stderr : outfile;
+        if (file == NULL) continue;
+        fprintf(file, "\n%s%s:\n", title, histfilename ? ", including earlier runs" : "");
+        fprintf(file, "  %-16s %10s %10s %10s %10s %10s %10s %10s\n",
+            "kind", "count", "min", "50%", "90%", "99%", "99.9%", "max");
+        for (int kind = first; kind <= last; ++kind) if (timing[kind].count) {
+            const struct histogram *h = &timing[kind];
+            fprintf(file, "  %-16s %10llu %10llu", hist_name(kind), h->count, h->min);
+            for (int p = 0; p < NUM_PERCENTS; ++p)
+                fprintf(file, " %10llu", hist_percentile(h, percents[p]));
+            fprintf(file, " %10llu\n", h->max);
+        }
+    }
+}
+
+void show_histograms(void) {
+    if (!timing_histograms) return;
+    show_histogram_table("time since the previous transaction, in usec", 0, HIST_STX_TO_SRX);
+    show_histogram_table("times from the Sniffer's cycle counter, in nsec", HIST_BYTE_GAP_NS, HIST_KINDS-1);
+    if (histfilename) save_histograms();
+}
+
+
+//****************** cycle times ******************
+
+/* Sniffer firmware with CYCLE_TIMES sends, before each event, the number of
+cycles of its clock since the event before ("knnn."), and at the start of each
+buffer how fast the clock runs ("Knnn."). We keep the total number of cycles,
+and turn it into nanoseconds, and the microseconds the rest of the decoder
+uses, without adding up rounding errors. We also see when each byte of a
+transaction came, so for bursts we show how long the bytes took and how far
+apart they were, and how long slave select was high before. */
+
+struct {
+    unsigned long long select_ns, unselect_ns, high_ns, first_ns, last_ns, gap_min, gap_max;
+    unsigned bytes;
+    bool selected, unselected;  // whether we know when
+} txn_timing;
+
+void set_cycle_hz(unsigned long hz) {
+    if (hz == 0 || hz == cycle_hz) return;
+    if (cycle_hz) capture_cycles = (unsigned long long)((double)event_ns * hz / 1e9);  // the rate changed
+    cycle_hz = hz;
+}
+
+void advance_cycles(unsigned long long cycles) {  // that much time has passed
+    unsigned long long ns, usec;
+    if (cycle_hz == 0) cycle_hz = CYCLE_HZ_DEFAULT;
+    capture_cycles += cycles;
+    ns = capture_cycles / cycle_hz * 1000000000 + capture_cycles % cycle_hz * 1000000000 / cycle_hz;
+    if (ns <= event_ns) return;
+    cmd_delta_ns += ns - event_ns;
+    event_ns = ns;
+    usec = ns / 1000;
+    if (usec > capture_time_usec) {
+        cmd_delta_time += (unsigned long)(usec - capture_time_usec);
+        packet.delta_time_usec += (unsigned long)(usec - capture_time_usec);
+        capture_time_usec = usec;
+    }
+}
+
+void time_select(void) {
+    txn_timing.high_ns = txn_timing.unselected ? event_ns - txn_timing.unselect_ns : 0;
+    if (txn_timing.unselected && timing_histograms) hist_add(HIST_SS_HIGH_NS, txn_timing.high_ns, 1);
+    txn_timing.select_ns = event_ns;
+    txn_timing.selected = true;
+    txn_timing.bytes = 0;
+}
+
+void time_byte(void) {
+    if (txn_timing.bytes > 0) {
+        unsigned long long gap = event_ns - txn_timing.last_ns;
+        if (timing_histograms) hist_add(HIST_BYTE_GAP_NS, gap, 1);
+        if (txn_timing.bytes == 1 || gap < txn_timing.gap_min) txn_timing.gap_min = gap;
+        if (txn_timing.bytes == 1 || gap > txn_timing.gap_max) txn_timing.gap_max = gap;
+    }
+    else txn_timing.first_ns = event_ns;
+    txn_timing.last_ns = event_ns;
+    ++txn_timing.bytes;
+}
+
+void time_unselect(void) {
+    if (txn_timing.selected) {
+        if (timing_histograms) hist_add(HIST_TRANSACTION_NS, event_ns - txn_timing.select_ns, 1);
+        if (txn_timing.bytes > 2) {  // a burst
+            output("  (%u bytes in %.3f usec, %.3f to %.3f usec apart", txn_timing.bytes,
+                (txn_timing.last_ns - txn_timing.first_ns) / 1e3, txn_timing.gap_min / 1e3, txn_timing.gap_max / 1e3);
+            if (txn_timing.high_ns) output(", after select was high for %.3f usec", txn_timing.high_ns / 1e3);
+            output(")\n");
+        }
+    }
+    txn_timing.unselect_ns = event_ns;
+    txn_timing.unselected = true;
+    txn_timing.selected = false;
+}
+
+
+//***************** decode a chunk of input *************************
+
+int complete_length(char *buf, int len) {  // leave off a number or a data pair at the end that hasn't all arrived
+    int end = len;
+    while (end > 0 && isdigit((byte)buf[end-1])) --end;
+    if (end > 0 && strchr("tkKw", buf[end-1])) return end - 1;  // a time or a count without its '.'
+    for (end = len; end > 0 && isxdigit((byte)buf[end-1]); --end) ;
+    return len - (len - end) % 4;  // the first half of a data pair
+}
+
+void drop_held_text(void) {  // at the end of the input: what never finished can't be decoded
+    if (held_len > 0) output("*** the input ended in the middle of \"%.*s\", which isn't decoded\n", held_len, held_text);
+    held_len = 0;
+}
+
+void decode_input(char *raw, int len) {
+    int end, n = held_len;
+    memcpy(line, held_text, n);  // what was left over from last time goes first
+    held_len = 0;
+    n += sc_expand(&expander, raw, len, &line[n]);  // undo any compression
+    end = n;
+    n = 0;
+    for (int i = 0; i < end; ++i)  // line breaks mean nothing, and a recorded file may have them even inside a number
+        if (line[i] != '\r' && line[i] != '\n') line[n++] = line[i];
+    end = complete_length(line, n);
+    if (n - end <= (int)sizeof(held_text)) {  // keep it until the rest arrives
+        held_len = n - end;
+        memcpy(held_text, &line[end], held_len);
+    }
+    else end = n;
+    line[end] = '\0';
+    // output("decode %n bytes: %s\n", bytes_read, line);
+    lineptr = line;
+    while (*lineptr != '\0') {
+        skip_to_next_data();  // process input up to next master/slave data pair
+        if (*lineptr == '\0')break;
+next_command:
+        if (!read_data_pair()) continue;
+        isread = master_data & 0x80; 	// "read register" flag bit
+        isburst = master_data & 0x40;	// "burst" flag bit
+        regnum = master_data & 0x3f;  	// register number 0 to 63
+        if (timing_histograms) time_transaction();
+        if (packet.length != 0 && !packet_continues()) packet_flush();
+
+        if (isread) { //  config register read
+            if (regnum >= 0x30 && regnum <= 0x3d && !isburst) { // no, is really command strobe
+                command_strobe();
+            }
+            else {
+                if(isburst){
+                    if (regnum == 0x3f) { // read RX FIFO: receive packet
+                        bool continuing = packet.length != 0, status_byte = continuing;
+                        if (!chip_selected) warn_bad_data(BAD_UNSELECTED, regnum);
+                        show_config_reg("read", true);
+                        packet.xmit = false;
+                        while (1) { // show all burst read data from FIFO
                             if (!skip_timestamp()) goto next_command;
                             if (*lineptr == ']') break; // ends with chip unselect
-                            if (regnum > 0x2e) exit_msg("too much burst data", regnum);
                             if (!read_data_pair()) goto next_command;
-                            new_config_regs[regnum++] = master_data;
-                            ++bytes_bursted;
+                            output(" %02X", slave_data);
+                            if (status_byte) status_byte = false;  // we already have one
+                            else packet_add(slave_data);
                         }
-                        end_reg = regnum-1;
-                        for (regnum=start_reg; regnum<end_reg; ++regnum) {  // show only those that changed
-                            if ((new_config_regs[regnum] != current_config_regs[regnum])) {
-                                regval = new_config_regs[regnum];
-                                show_config_reg(" wrote", false);
-                                current_config_regs[regnum] = new_config_regs[regnum];
-                                ++bytes_changed;
+                        output("\n");
+                        if (track_radio && !continuing) radio_rx_fifo();
+                        packet_fifo_done();
+                    }
+                    else  { // burst read of other than FIFO: consecutive config registers
+                        if (!skip_to_next_data()) goto next_command;
+                        while (1) {
+                            if (!skip_timestamp()) goto next_command;
+                            if (*lineptr == ']') break; // ends with chip unselect
+                            if (!read_data_pair()) goto next_command;
+                            regval = slave_data;
+                            show_config_reg("read", false);
+                            if (track_radio && regnum == 0x35) radio_status(regval);
+                            if (++regnum >= 0x40) {
+                                recover_after_bad_data(BAD_BURST_READ);
+                                goto next_command;
                             }
                         }
-                        show_delta_time();
-                        output(" burst wrote %d registers, and %d changed\n", bytes_bursted, bytes_changed);
                     }
-                    else {  // single register write
+                }
+                else { // regular single-register read
+                    if (!read_data_pair()) goto next_command;
+                    regval = slave_data;
+                    show_config_reg("read", false);
+                }
+            }
+        }
+        else { // register write
+            if (regnum >= 0x30 && regnum <= 0x3d && !isburst) { // no, is really command strobe
+                command_strobe();
+            }
+            else if (regnum == 0x3e) { // write power table
+                if (isburst) {
+                    if (!chip_selected) warn_bad_data(BAD_UNSELECTED, regnum);
+                    show_config_reg("write", true);
+                    while (1) { // show all burst write data to power table
+                        if (!skip_timestamp()) goto next_command;
+                        if (*lineptr == ']') break; // ends with chip unselect
+                        if (!read_data_pair()) goto next_command;
+                        output(" %02X", master_data);
+                    }
+                    output("\n");
+                }
+                else { // non-burst write to power table
+                    if (!read_data_pair()) goto next_command;
+                    regval = master_data;
+                    show_config_reg("write", false);
+                }
+            }
+            else if (regnum == 0x3f) { // write TX FIFO: transmit packet
+                if (!isburst) { // we haven't seen this yet
+                    recover_after_bad_data(BAD_SINGLE_FIFO);
+                    goto next_command;
+                }
+                unsigned before = packet.length;
+                if (!chip_selected) warn_bad_data(BAD_UNSELECTED, regnum);
+                show_config_reg("write", true);
+                packet.xmit = true;
+                while (1) { // show all burst write data to FIFO
+                    if (!skip_timestamp()) goto next_command;
+                    if (*lineptr == ']') break; // ends with chip unselect
+                    if (!read_data_pair()) goto next_command;
+                    output(" %02X", master_data);
+                    packet_add(master_data);
+                }
+                output("\n");
+                if (track_radio) radio_tx_fifo(packet.length - before);
+                packet_fifo_done();
+            }
+            else { // writing config register(s)
+                if (isburst) { // burst config register write
+                    int bytes_bursted, bytes_changed, start_reg, end_reg;
+                    bytes_bursted = 0;
+                    bytes_changed = 0;
+                    start_reg = regnum;
+                    // output("burst config write\n");
+                    if (!chip_selected) output("burst write without chip selected at reg %02X", regnum);
+                    while (1) { // read all the burst write data
+                        if (!skip_timestamp()) goto next_command;
+                        if (*lineptr == ']') break; // ends with chip unselect
+                        if (regnum > 0x2e) {
+                            recover_after_bad_data(BAD_BURST_WRITE);
+                            goto next_command;
+                        }
                         if (!read_data_pair()) goto next_command;
-                        regval = master_data;
-                        show_config_reg("write", false);
-                        current_config_regs[regnum] = regval;
+                        config_written[regnum] = true;
+                        new_config_regs[regnum++] = master_data;
+                        ++bytes_bursted;
+                    }
+                    end_reg = regnum-1;
+                    for (regnum=start_reg; regnum<=end_reg; ++regnum) {  // show only those that changed
+                        if ((new_config_regs[regnum] != current_config_regs[regnum])) {
+                            regval = new_config_regs[regnum];
+                            show_config_reg(" wrote", false);
+                            current_config_regs[regnum] = new_config_regs[regnum];
+                            ++bytes_changed;
+                        }
+                    }
+                    show_delta_time();
+                    output(" burst wrote %d registers, and %d changed\n", bytes_bursted, bytes_changed);
+                    if (record_events) {
+                        byte event[65];
+                        event[0] = (byte)start_reg;
+                        memcpy(&event[1], &new_config_regs[start_reg], bytes_bursted);
+                        event_record(PKT_CONFIG, event, bytes_bursted+1);
+                    }
+                }
+                else {  // single register write
+                    if (!read_data_pair()) goto next_command;
+                    regval = master_data;
+                    show_config_reg("write", false);
+                    current_config_regs[regnum] = regval;
+                    config_written[regnum] = true;
+                    if (record_events) {
+                        byte event[2] = {regnum, regval};
+                        event_record(PKT_CONFIG, event, 2);
                     }
                 }
             }
         }
     }
+}
+
+
+//****************** merging captures from several Sniffers ******************
+
+/* Each capture only has its own relative times, but when Sniffers watch devices
+that talk to each other, the same packet shows up as sent in one capture and
+received in another. We decode each capture into a temporary file of binary
+packet records, estimate the clock offset and drift of each capture relative
+to the first from those matches, and then merge all the packets into one
+timeline with a k-way merge that keeps only one packet per capture in memory.
+
+To find matches in constant memory we remember a sample of the packets of the
+captures aligned so far in a fixed-size table, with their times converted to
+the first capture's. The sample is chosen by the hash of the packet contents,
+so all the captures sample the same packets, and the sampling gets sparser
+whenever the table fills up. Each round, every capture not yet aligned is read
+once and matched against all the aligned ones together, and those it aligns
+are added to the table for the next round. So a capture is added to the table
+only once, and is read once per round instead of once for each aligned
+capture. There is a round for each step of the longest chain of captures that
+only match through each other, which is usually one.
+
+The offset can jump in the middle of a capture, for instance when a Sniffer
+lost time while it was sending. So the matches are grouped into clusters that
+each agree on an offset, and a capture can be aligned in pieces, one for each
+cluster, as long as the pieces don't overlap and keep the packets in order.
+A drift is only fitted to a piece whose matches span long enough to show one.
+A capture that can't be aligned is reported with the best cluster we found. */
+
+#define MATCH_TABLE 4096      // sampled packets remembered for matching; a power of 2
+#define MATCH_BYTES 8         // how much of the start of the data has to match
+#define MATCH_MIN_BYTES 4
+#define MATCH_VOTES 2048      // matches kept for the first estimate
+#define MATCH_WINDOW 50000    // usec: how close matches have to be to the first estimate
+#define MATCH_TOLERANCE 20000 // usec: how close matches have to be to the fitted line. A packet is
+                              // recorded as sent before its air time and as received after it, so
+                              // the offsets from the two directions are twice that apart.
+#define MATCH_MIN 3           // matches needed to align two captures
+#define MATCH_PIECE_MIN 2     // and for each piece, when the offset jumps
+#define MATCH_PIECES 8        // the most pieces a capture is aligned in
+#define MATCH_DRIFT_SPAN 10e6 // usec: how far apart a piece's matches have to be to fit a drift
+#define MATCH_MAX_DRIFT 1e-3  // a steeper line is a bad fit, not a clock
+
+struct merge_piece {
+    double from;           // the capture time it starts at; the first one also covers before that
+    double first, last;    // the capture times of its first and last matches
+    double offset, rate;   // reference time = offset + rate * capture time
+    unsigned long matches;
+};
+
+struct capture {
+    char *filename;
+    FILE *pktrecs;         // the decoded packets, as binary records
+    unsigned long numpkts;
+    bool aligned;
+    struct merge_piece pieces[MATCH_PIECES];
+    int numpieces;
+    int aligned_to;        // the capture we found matches with
+    unsigned long matches;
+    unsigned long best_votes;  // if it isn't aligned: the biggest cluster of matches we found
+    double best_offset;
+    struct pkt_record rec; // the next packet, during the merge
+    byte *data;
+    unsigned datasize;
+    double merge_time;
+};
+
+struct match_entry {
+    unsigned long long key;   // 0 if unused
+    double time_usec;         // in the first capture's time
+    unsigned count;
+    int cap;                  // which capture it came from
+} match_table[MATCH_TABLE];
+unsigned long long match_sample_mask;
+int match_entries;
+
+struct match_vote {
+    double x, y;  // capture time, and the first capture's time minus it
+} match_votes[MATCH_VOTES];
+
+struct match_fit {  // sums for a least squares line, in seconds
+    double n, sx, sy, sxx, sxy;
+};
+unsigned long match_votes_seen;
+unsigned long long match_random_state;
+unsigned long *match_partners;  // for each capture, the matches with it in the final fit
+
+void reset_decoder(void) {  // forget everything about the previous capture
+    chip_selected = false;
+    memset(current_config_regs, 0, sizeof(current_config_regs));
+    memset(new_config_regs, 0, sizeof(new_config_regs));
+    memset(config_written, 0, sizeof(config_written));
+    packet.length = packet.bursts = packet.done_length = 0;
+    packet.delta_time_usec = 0;
+    memset(&expander, 0, sizeof(expander));
+    cmd_delta_time = 0;
+    capture_time_usec = 0;
+    cycle_hz = 0;
+    capture_cycles = event_ns = cmd_delta_ns = 0;
+    memset(&txn_timing, 0, sizeof(txn_timing));
+    last_txn_known = srx_pending = stx_pending = false;
+    line[0] = '\0';
+    lineptr = line;
+}
+
+void decode_capture(struct capture *cap) {
+    FILE *file;
+    char *ext = strrchr(cap->filename, '.');
+    if (ext && strcmp(ext, ".bin") == 0) {  // already binary records, from -b or -i
+        struct pkt_record rec;
+        if ((cap->pktrecs = fopen(cap->filename, "rb")) == NULL) {
+            fprintf(stderr, "%s open for read failed\n", cap->filename);
+            cleanup();
+            exit(98);
+        }
+        for (cap->numpkts = 0; read_pkt_record(cap->pktrecs, &rec, &cap->data, &cap->datasize); ) ++cap->numpkts;
+        rewind(cap->pktrecs);
+        return;
+    }
+    if ((file = fopen(cap->filename, "r")) == NULL) {
+        fprintf(stderr, "%s open for read failed\n", cap->filename);
+        cleanup();
+        exit(98);
+    }
+    if ((cap->pktrecs = tmpfile()) == NULL) fatal_err("can't create temporary file");
+    fprintf(stderr, "decoding %s\n", cap->filename);
+    output("\n*** decoding %s\n", cap->filename);
+    reset_decoder();
+    pktrecfile = cap->pktrecs;
+    pkt_records = 0;
+    while (fgets(rawline, MAX_LINE, file)) decode_input(rawline, strlen(rawline));
+    packet_flush();
+    pktrecfile = NULL;
+    fclose(file);
+    cap->numpkts = pkt_records;
+}
+
+unsigned long long match_key(const struct pkt_record *rec, const byte *data, int skip, byte type) {
+    // the hash of what should be the same at both ends, or 0 if not enough
+    unsigned long long key = 14695981039346656037ULL;  // FNV-1a
+    int len = rec->length - skip;
+    if (len > MATCH_BYTES) len = MATCH_BYTES;
+    if (len < MATCH_MIN_BYTES) return 0;
+    key = (key ^ type) * 1099511628211ULL;
+    key = (key ^ rec->chan) * 1099511628211ULL;
+    key = (key ^ rec->sync1) * 1099511628211ULL;
+    key = (key ^ rec->sync0) * 1099511628211ULL;
+    for (int i=0; i<len; ++i) key = (key ^ data[skip+i]) * 1099511628211ULL;
+    return key | 1;
+}
+
+int packet_keys(const struct pkt_record *rec, const byte *data, byte type, unsigned long long keys[2]) {
+    /* A received packet may start with a status byte that isn't in the transmitted
+    packet, so we try it both ways. "type" is what the packet would be at the
+    other end. */
+    int numkeys = 0;
+    if (rec->type != PKT_SENT && rec->type != PKT_RCVD) return 0;
+    if ((keys[numkeys] = match_key(rec, data, 0, type)) != 0) ++numkeys;
+    if (rec->type == PKT_RCVD && (keys[numkeys] = match_key(rec, data, 1, type)) != 0) ++numkeys;
+    return numkeys;
+}
+
+struct match_entry *match_find(unsigned long long key) {
+    unsigned i = (unsigned)(key >> 20) & (MATCH_TABLE-1);
+    while (match_table[i].key != 0 && match_table[i].key != key) i = (i+1) & (MATCH_TABLE-1);
+    return &match_table[i];
+}
+
+void match_add(unsigned long long key, double time_usec, int cap) {
+    struct match_entry *entry;
+    if ((key & match_sample_mask) != 0) return;  // not in the sample
+    entry = match_find(key);
+    if (entry->key == key) {
+        if (entry->cap != cap && fabs(entry->time_usec - time_usec) <= MATCH_WINDOW) return;
+        // (the same packet, received by another capture too)
+        ++entry->count;
+        return;
+    }
+    entry->key = key;
+    entry->time_usec = time_usec;
+    entry->count = 1;
+    entry->cap = cap;
+    if (++match_entries > MATCH_TABLE*3/4) { // too full: sample half as many
+        static struct match_entry old[MATCH_TABLE];
+        memcpy(old, match_table, sizeof(old));
+        memset(match_table, 0, sizeof(match_table));
+        match_sample_mask = (match_sample_mask << 1) | 1;
+        match_entries = 0;
+        for (int i=0; i<MATCH_TABLE; ++i)
+            if (old[i].key != 0 && (old[i].key & match_sample_mask) == 0) {
+                *match_find(old[i].key) = old[i];
+                ++match_entries;
+            }
+    }
+}
+
+double reference_time(const struct capture *cap, double t) {  // a capture's time in the first capture's
+    const struct merge_piece *p = &cap->pieces[0];
+    for (int i=1; i<cap->numpieces && t >= cap->pieces[i].from; ++i) p = &cap->pieces[i];
+    return p->offset + p->rate * t;
+}
+
+void match_build(struct capture *cap, int capnum) { // add a sample of an aligned capture's packets
+    struct pkt_record rec;
+    unsigned long long keys[2];
+    rewind(cap->pktrecs);
+    while (read_pkt_record(cap->pktrecs, &rec, &cap->data, &cap->datasize)) {
+        // remember it under what it would be at the other end
+        int numkeys = packet_keys(&rec, cap->data, rec.type == PKT_SENT ? PKT_RCVD : PKT_SENT, keys);
+        for (int k=0; k<numkeys; ++k) match_add(keys[k], reference_time(cap, rec.time_usec), capnum);
+    }
+}
+
+struct match_entry *match_lookup(const struct pkt_record *rec, const byte *data) {
+    // find an unambiguous match for a packet in the table
+    unsigned long long keys[2];
+    int numkeys = packet_keys(rec, data, rec->type, keys);
+    for (int k=0; k<numkeys; ++k) {
+        struct match_entry *entry;
+        if ((keys[k] & match_sample_mask) != 0) continue;
+        entry = match_find(keys[k]);
+        if (entry->key == keys[k] && entry->count == 1) return entry;
+    }
+    return NULL;
+}
+
+unsigned long match_random(unsigned long n) {
+    /* A random number from 0 to n-1, all equally likely, for any n. rand() can
+    stop at 32767, and taking it modulo n favours the small numbers. This is
+    splitmix64, and we draw again when it falls in the incomplete last group of
+    n at the top of its range. */
+    unsigned long long r, limit = ULLONG_MAX - ULLONG_MAX % n;
+    do {
+        r = (match_random_state += 0x9E3779B97F4A7C15ULL);
+        r = (r ^ (r >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        r = (r ^ (r >> 27)) * 0x94D049BB133111EBULL;
+        r ^= r >> 31;
+    } while (r >= limit);
+    return (unsigned long)(r % n);
+}
+
+int compare_votes(const void *a, const void *b) {
+    double diff = ((const struct match_vote *)a)->y - ((const struct match_vote *)b)->y;
+    return diff < 0 ? -1 : diff > 0 ? 1 : 0;
+}
+
+void fit_add(struct match_fit *fit, double x_usec, double y_usec) {
+    double x = x_usec / 1e6, y = y_usec / 1e6;
+    fit->n += 1; fit->sx += x; fit->sy += y; fit->sxx += x*x; fit->sxy += x*y;
+}
+
+void fit_piece(struct merge_piece *p, const struct match_fit *fit) {  // the offset, and the drift if we can tell
+    double slope = 0, det = fit->n*fit->sxx - fit->sx*fit->sx;
+    if (p->last - p->first >= MATCH_DRIFT_SPAN && det > 1e-9) {
+        slope = (fit->n*fit->sxy - fit->sx*fit->sy) / det;
+        if (fabs(slope) > MATCH_MAX_DRIFT) slope = 0;
+    }
+    p->rate = 1 + slope;
+    p->offset = (fit->sy - slope*fit->sx) / fit->n * 1e6;
+}
+
+int match_cluster(int numvotes, struct merge_piece *p) {
+    /* Take the biggest cluster of votes that agree on the offset out of the
+    sorted votes, and fit a piece to it. Returns how many are left. */
+    int best_start = 0, best_count = 0;
+    struct match_fit fit = {0};
+    for (int start=0, end=0; start<numvotes; ++start) {
+        while (end < numvotes && match_votes[end].y - match_votes[start].y <= MATCH_WINDOW) ++end;
+        if (end - start > best_count) {
+            best_count = end - start;
+            best_start = start;
+        }
+    }
+    p->first = p->last = match_votes[best_start].x;
+    for (int i=best_start; i<best_start+best_count; ++i) {
+        fit_add(&fit, match_votes[i].x, match_votes[i].y);
+        if (match_votes[i].x < p->first) p->first = match_votes[i].x;
+        if (match_votes[i].x > p->last) p->last = match_votes[i].x;
+    }
+    p->matches = best_count;
+    fit_piece(p, &fit);
+    memmove(&match_votes[best_start], &match_votes[best_start+best_count],
+        (numvotes - best_start - best_count) * sizeof(struct match_vote));
+    return numvotes - best_count;
+}
+
+bool piece_fits(const struct merge_piece *pieces, int numpieces, const struct merge_piece *p) {
+    // doesn't overlap the others, and keeps the packets in order with its neighbours
+    for (int i=0; i<numpieces; ++i) {
+        const struct merge_piece *q = &pieces[i];
+        if (p->last >= q->first && p->first <= q->last) return false;
+        if (q->last < p->first && q->offset + q->rate*q->last > p->offset + p->rate*p->first) return false;
+        if (p->last < q->first && p->offset + p->rate*p->last > q->offset + q->rate*q->first) return false;
+    }
+    return true;
+}
+
+int compare_pieces(const void *a, const void *b) {
+    double diff = ((const struct merge_piece *)a)->first - ((const struct merge_piece *)b)->first;
+    return diff < 0 ? -1 : diff > 0 ? 1 : 0;
+}
+
+unsigned long match_captures(struct capture *cap, int numcaps, int *partner) {
+    /* Find how to convert times in "cap" to the first capture's times, using the
+    aligned captures in the match table, and put that in its pieces. Returns the
+    number of matches, and the capture with the most of them. */
+    struct pkt_record rec;
+    struct match_entry *entry;
+    struct merge_piece candidate, *pieces = cap->pieces;
+    struct match_fit fits[MATCH_PIECES];
+    int numvotes, numpieces = 0, tries;
+    unsigned long total = 0;
+
+    // first, the most popular offsets among a sample of the matches
+    cap->best_votes = 0;
+    match_votes_seen = 0;
+    match_random_state = 0;  // the same sample every time
+    rewind(cap->pktrecs);
+    while (read_pkt_record(cap->pktrecs, &rec, &cap->data, &cap->datasize))
+        if ((entry = match_lookup(&rec, cap->data)) != NULL) {
+            unsigned long slot = match_votes_seen++;
+            if (slot >= MATCH_VOTES) slot = match_random(match_votes_seen);  // reservoir sampling
+            if (slot < MATCH_VOTES) {
+                match_votes[slot].x = (double)rec.time_usec;
+                match_votes[slot].y = entry->time_usec - (double)rec.time_usec;
+            }
+        }
+    numvotes = match_votes_seen < MATCH_VOTES ? match_votes_seen : MATCH_VOTES;
+    qsort(match_votes, numvotes, sizeof(struct match_vote), compare_votes);
+    for (tries = 0; numvotes > 0 && numpieces < MATCH_PIECES && tries < 4*MATCH_PIECES; ++tries) {
+        numvotes = match_cluster(numvotes, &candidate);
+        if (tries == 0) {
+            cap->best_votes = candidate.matches;
+            cap->best_offset = candidate.offset;
+        }
+        if (candidate.matches < MATCH_PIECE_MIN) break;
+        if (piece_fits(pieces, numpieces, &candidate)) {
+            pieces[numpieces++] = candidate;
+            total += candidate.matches;
+        }
+    }
+    if (total < MATCH_MIN) return 0;
+    qsort(pieces, numpieces, sizeof(struct merge_piece), compare_pieces);
+    pieces[0].from = 0;
+    for (int i=1; i<numpieces; ++i) pieces[i].from = (pieces[i-1].last + pieces[i].first) / 2;
+    cap->numpieces = numpieces;
+
+    // then a line for each piece through all the matches close to it
+    memset(fits, 0, sizeof(fits));
+    memset(match_partners, 0, numcaps * sizeof(*match_partners));
+    for (int i=0; i<numpieces; ++i) pieces[i].matches = 0;
+    total = 0;
+    rewind(cap->pktrecs);
+    while (read_pkt_record(cap->pktrecs, &rec, &cap->data, &cap->datasize))
+        if ((entry = match_lookup(&rec, cap->data)) != NULL) {
+            int i = 0;
+            while (i+1 < numpieces && rec.time_usec >= pieces[i+1].from) ++i;
+            if (fabs(entry->time_usec - reference_time(cap, rec.time_usec)) <= MATCH_TOLERANCE) {
+                if (pieces[i].matches++ == 0) pieces[i].first = rec.time_usec;
+                pieces[i].last = rec.time_usec;
+                fit_add(&fits[i], rec.time_usec, entry->time_usec - (double)rec.time_usec);
+                ++match_partners[entry->cap];
+                ++total;
+            }
+        }
+    if (total < MATCH_MIN) return 0;
+    for (int i=0; i<numpieces; ++i) if (pieces[i].matches > 0) fit_piece(&pieces[i], &fits[i]);
+    *partner = 0;
+    for (int i=1; i<numcaps; ++i) if (match_partners[i] > match_partners[*partner]) *partner = i;
+    return total;
+}
+
+/* The merge heap: the capture with the earliest next packet is at the top. */
+
+struct capture **heap;
+int heapsize;
+
+void heap_down(int i) {
+    while (1) {
+        int smallest = i, left = 2*i+1, right = 2*i+2;
+        struct capture *tmp;
+        if (left < heapsize && heap[left]->merge_time < heap[smallest]->merge_time) smallest = left;
+        if (right < heapsize && heap[right]->merge_time < heap[smallest]->merge_time) smallest = right;
+        if (smallest == i) return;
+        tmp = heap[i]; heap[i] = heap[smallest]; heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+bool merge_next(struct capture *cap) { // read a capture's next packet
+    do if (!read_pkt_record(cap->pktrecs, &cap->rec, &cap->data, &cap->datasize)) return false;
+    while (cap->rec.type == PKT_STROBE || cap->rec.type == PKT_CONFIG);  // from a -b file
+    cap->merge_time = reference_time(cap, cap->rec.time_usec);
+    return true;
+}
+
+void merge_captures(int numcaps, char *filenames[]) {
+    struct capture *caps;
+    FILE *mrgfile;
+    bool progress;
+    double last_time = 0, start_time = 0;
+
+    if ((caps = calloc(numcaps, sizeof(struct capture))) == NULL
+            || (heap = calloc(numcaps, sizeof(struct capture *))) == NULL)
+        fatal_err("out of memory for captures");
+    for (int i=0; i<numcaps; ++i) {
+        caps[i].filename = filenames[i];
+        caps[i].numpieces = 1;
+        caps[i].pieces[0].rate = 1;
+        caps[i].aligned_to = -1;
+        decode_capture(&caps[i]);
+    }
+
+    // align the captures to the first one, directly or through others
+    if ((match_partners = calloc(numcaps, sizeof(*match_partners))) == NULL) fatal_err("out of memory for captures");
+    memset(match_table, 0, sizeof(match_table));
+    match_sample_mask = 0;
+    match_entries = 0;
+    caps[0].aligned = true;
+    match_build(&caps[0], 0);
+    do {
+        progress = false;
+        for (int i=0; i<numcaps; ++i) if (!caps[i].aligned) {
+                unsigned long matches;
+                int partner;
+                if ((matches = match_captures(&caps[i], numcaps, &partner)) > 0) {
+                    caps[i].aligned = true;
+                    caps[i].aligned_to = partner;
+                    caps[i].matches = matches;
+                    match_build(&caps[i], i);
+                    progress = true;
+                }
+            }
+    }
+    while (progress);
+    free(match_partners);
+
+    if ((mrgfile = fopen(MRGFILENAME, "a")) == NULL) fatal_err(MRGFILENAME " open failed");
+    fprintf(mrgfile, "\nmerge of %d captures\n", numcaps);
+    for (int i=0; i<numcaps; ++i) {
+        fprintf(mrgfile, "  %c%d: %s, %lu packets", 'A'+i%26, i/26, caps[i].filename, caps[i].numpkts);
+        if (i == 0) fprintf(mrgfile, ", the reference\n");
+        else if (caps[i].aligned && caps[i].numpieces == 1)
+            fprintf(mrgfile, ", offset %.6f sec, drift %+.1f ppm, from %lu matches with %c%d\n",
+                caps[i].pieces[0].offset/1e6, (caps[i].pieces[0].rate-1)*1e6, caps[i].matches,
+                'A'+caps[i].aligned_to%26, caps[i].aligned_to/26);
+        else if (caps[i].aligned) {
+            fprintf(mrgfile, ", in %d pieces from %lu matches with %c%d:\n", caps[i].numpieces,
+                caps[i].matches, 'A'+caps[i].aligned_to%26, caps[i].aligned_to/26);
+            for (int p=0; p<caps[i].numpieces; ++p)
+                fprintf(mrgfile, "      from %.6f sec: offset %.6f sec, drift %+.1f ppm, %lu matches\n",
+                    p == 0 ? 0 : caps[i].pieces[p].from/1e6, caps[i].pieces[p].offset/1e6,
+                    (caps[i].pieces[p].rate-1)*1e6, caps[i].pieces[p].matches);
+        }
+        else if (caps[i].best_votes == 0) fprintf(mrgfile, ", no matches: assumed to start with the reference\n");
+        else fprintf(mrgfile, ", not aligned: the best was %lu matches at offset %.6f sec, and %d are needed;"
+                " assumed to start with the reference\n", caps[i].best_votes, caps[i].best_offset/1e6, MATCH_MIN);
+    }
+    for (int i=0; i<numcaps; ++i) if (!caps[i].aligned) {
+            if (caps[i].best_votes == 0) fprintf(stderr, "%s could not be aligned with the others: no matches\n", caps[i].filename);
+            else fprintf(stderr, "%s could not be aligned with the others: the best was %lu matches at offset %.6f sec,"
+                    " and %d are needed\n", caps[i].filename, caps[i].best_votes, caps[i].best_offset/1e6, MATCH_MIN);
+        }
+
+    // the k-way merge
+    heapsize = 0;
+    for (int i=0; i<numcaps; ++i) {
+        rewind(caps[i].pktrecs);
+        if (merge_next(&caps[i])) heap[heapsize++] = &caps[i];
+    }
+    for (int i=heapsize/2-1; i>=0; --i) heap_down(i);
+    if (heapsize > 0) start_time = last_time = heap[0]->merge_time;
+    while (heapsize > 0) {
+        struct capture *cap = heap[0];
+        double time = cap->merge_time - start_time;
+        fprintf(mrgfile, "%4ld.%06ld %+10.6f %c%d ", (long)(time/1e6), (long)fmod(time, 1e6),
+            (cap->merge_time - last_time)/1e6, 'A'+(int)(cap-caps)%26, (int)(cap-caps)/26);
+        show_packet(mrgfile, &cap->rec, cap->data);
+        show_class(mrgfile, &cap->rec, cap->data, classify(&cap->rec, cap->data));
+        fprintf(mrgfile, "\n");
+        last_time = cap->merge_time;
+        if (!merge_next(cap)) heap[0] = heap[--heapsize];
+        heap_down(0);
+    }
+    fclose(mrgfile);
+    for (int i=0; i<numcaps; ++i) {
+        fclose(caps[i].pktrecs);
+        free(caps[i].data);
+    }
+    free(caps);
+    free(heap);
+    fprintf(stderr, "merged into " MRGFILENAME "\n");
+}
+
+
+//****************** comparing two captures ******************
+
+/* To see what changed between two captures, for example before and after a
+firmware update, we decode both into streams of events that leave out the
+times: packets by their data, config register writes by the values written,
+and command strobes. Then we go through both streams together. While the
+events are the same we only check their timing. When they differ we look
+further and further ahead, up to CMP_MAX_WINDOW events, for the nearest place
+where CMP_KGRAM events in a row are the same again. The k-grams of one
+stream are found with a rolling hash and a hash table, so that costs time in
+proportion to how far we had to look. The events in between are aligned
+with an edit distance table if there aren't too many of them, and reported as
+missing, inserted, or changed. Only a window of each stream is in memory. */
+
+#define CMP_RING 8192         // events of each capture in memory; a power of 2
+#define CMP_MIN_WINDOW 16
+#define CMP_MAX_WINDOW 4096   // how far ahead we look to get back in step
+#define CMP_KGRAM 4           // how many events in a row have to be the same
+#define CMP_BAND 128          // the longest differences we align event by event
+#define CMP_TIMING_USEC 2000  // timing differences smaller than this are ignored
+
+struct cmp_event {
+    struct pkt_record rec;
+    unsigned long long key;   // the hash of what has to be the same
+    byte *data;               // from the pool of packet buffers
+};
+
+struct cmp_stream {
+    struct capture cap;
+    struct cmp_event ring[CMP_RING];
+    unsigned long long head, tail;  // event numbers; the ring has head up to tail
+    unsigned long long last_match_usec;
+    char name;
+} cmp[2];
+
+struct cmp_table_entry {
+    unsigned long long hash;
+    int pos;
+    unsigned generation;
+} cmp_table[2*CMP_MAX_WINDOW];
+unsigned cmp_generation;
+
+FILE *cmpfile;
+unsigned long cmp_matched, cmp_missing, cmp_inserted, cmp_changed, cmp_timing;
+bool cmp_started;
+
+unsigned long long event_key(const struct pkt_record *rec, const byte *data) {
+    unsigned long long key = 14695981039346656037ULL;  // FNV-1a
+    key = (key ^ rec->type) * 1099511628211ULL;
+    for (unsigned i=0; i<rec->length; ++i) key = (key ^ data[i]) * 1099511628211ULL;
+    return key;
+}
+
+bool same_kind(const struct cmp_event *a, const struct cmp_event *b) {
+    // could one be a changed version of the other?
+    if (a->rec.type != b->rec.type) return false;
+    if (a->rec.type == PKT_CONFIG) return a->data[0] == b->data[0];  // the same first register
+    return true;
+}
+
+unsigned long long cmp_available(struct cmp_stream *s, unsigned long long wanted) {
+    // read events until we have the number wanted, or the end
+    while (s->tail - s->head < wanted) {
+        struct cmp_event *ev = &s->ring[s->tail & (CMP_RING-1)];
+        if (!read_pkt_record(s->cap.pktrecs, &ev->rec, &s->cap.data, &s->cap.datasize)) break;
+        ev->key = event_key(&ev->rec, s->cap.data);
+        pool_free(ev->data);  // of the event that was here before
+        ev->data = pool_alloc(ev->rec.length);
+        memcpy(ev->data, s->cap.data, ev->rec.length);
+        ++s->tail;
+    }
+    return s->tail - s->head;
+}
+
+struct cmp_event *cmp_event(struct cmp_stream *s, unsigned long long n) {  // the n'th event from the head
+    return &s->ring[(s->head + n) & (CMP_RING-1)];
+}
+
+void cmp_show(char op, struct cmp_stream *s, struct cmp_event *ev) {
+    fprintf(cmpfile, "%c %c %4llu.%06llu ", op, s->name, ev->rec.time_usec/1000000, ev->rec.time_usec%1000000);
+    show_packet(cmpfile, &ev->rec, ev->data);
+    fprintf(cmpfile, "\n");
+}
+
+void cmp_match(void) {  // the events at the heads are the same
+    struct cmp_event *a = cmp_event(&cmp[0], 0), *b = cmp_event(&cmp[1], 0);
+    if (cmp_started) {
+        long long gap_a = a->rec.time_usec - cmp[0].last_match_usec;
+        long long gap_b = b->rec.time_usec - cmp[1].last_match_usec;
+        if (llabs(gap_b - gap_a) > CMP_TIMING_USEC && llabs(gap_b - gap_a) > llabs(gap_a) / 10) {
+            fprintf(cmpfile, "@ A %4llu.%06llu B %4llu.%06llu %+.6f sec later than in A: ",
+                a->rec.time_usec/1000000, a->rec.time_usec%1000000, b->rec.time_usec/1000000,
+                b->rec.time_usec%1000000, (gap_b - gap_a)/1e6);
+            show_packet(cmpfile, &b->rec, b->data);
+            fprintf(cmpfile, "\n");
+            ++cmp_timing;
+        }
+    }
+    cmp_started = true;
+    cmp[0].last_match_usec = a->rec.time_usec;
+    cmp[1].last_match_usec = b->rec.time_usec;
+    ++cmp[0].head;
+    ++cmp[1].head;
+    ++cmp_matched;
+}
+
+void cmp_differences(int len_a, int len_b) {
+    // report the events before the place where the streams are the same again
+    static unsigned short cost[CMP_BAND+1][CMP_BAND+1];
+    static char ops[2*CMP_BAND];
+    int i, j, numops = 0;
+    if (len_a > CMP_BAND || len_b > CMP_BAND) { // too many to line up: all missing and inserted
+        for (i=0; i<len_a; ++i) cmp_show('-', &cmp[0], cmp_event(&cmp[0], i));
+        for (j=0; j<len_b; ++j) cmp_show('+', &cmp[1], cmp_event(&cmp[1], j));
+        cmp_missing += len_a;
+        cmp_inserted += len_b;
+        cmp[0].head += len_a;
+        cmp[1].head += len_b;
+        return;
+    }
+    // the edit distance, where changing an event into another of the same kind costs 1
+    for (i=0; i<=len_a; ++i) for (j=0; j<=len_b; ++j) {
+            if (i == 0 || j == 0) cost[i][j] = i + j;
+            else {
+                struct cmp_event *a = cmp_event(&cmp[0], i-1), *b = cmp_event(&cmp[1], j-1);
+                unsigned short best = cost[i-1][j] + 1;
+                if (cost[i][j-1] + 1 < best) best = cost[i][j-1] + 1;
+                if (a->key == b->key && cost[i-1][j-1] < best) best = cost[i-1][j-1];
+                else if (same_kind(a, b) && cost[i-1][j-1] + 1 < best) best = cost[i-1][j-1] + 1;
+                cost[i][j] = best;
+            }
+        }
+    for (i=len_a, j=len_b; i>0 || j>0; ) {  // back from the end, then show them in order
+        if (i > 0 && j > 0) {
+            struct cmp_event *a = cmp_event(&cmp[0], i-1), *b = cmp_event(&cmp[1], j-1);
+            if (a->key == b->key && cost[i][j] == cost[i-1][j-1]) {
+                ops[numops++] = '=';
+                --i; --j;
+                continue;
+            }
+            if (same_kind(a, b) && cost[i][j] == cost[i-1][j-1] + 1) {
+                ops[numops++] = '~';
+                --i; --j;
+                continue;
+            }
+        }
+        if (i > 0 && cost[i][j] == cost[i-1][j] + 1) {
+            ops[numops++] = '-';
+            --i;
+        }
+        else {
+            ops[numops++] = '+';
+            --j;
+        }
+    }
+    while (numops--) switch (ops[numops]) {
+        case '=':
+            cmp_match();
+            break;
+        case '~':
+            cmp_show('~', &cmp[0], cmp_event(&cmp[0], 0));
+            cmp_show('~', &cmp[1], cmp_event(&cmp[1], 0));
+            ++cmp[0].head;
+            ++cmp[1].head;
+            ++cmp_changed;
+            break;
+        case '-':
+            cmp_show('-', &cmp[0], cmp_event(&cmp[0], 0));
+            ++cmp[0].head;
+            ++cmp_missing;
+            break;
+        case '+':
+            cmp_show('+', &cmp[1], cmp_event(&cmp[1], 0));
+            ++cmp[1].head;
+            ++cmp_inserted;
+        }
+}
+
+bool cmp_find(int window, int k, int *pos_a, int *pos_b) {
+    // find the nearest place in the windows where k events in a row are the same
+    int len_a = (int)cmp_available(&cmp[0], window + k), len_b = (int)cmp_available(&cmp[1], window + k);
+    unsigned long long hash = 0, power = 1, mult = 1099511628211ULL;
+    int best = INT_MAX;
+    if (len_a > window + k) len_a = window + k;
+    if (len_b > window + k) len_b = window + k;
+    if (len_a < k || len_b < k) return false;
+    for (int i=1; i<k; ++i) power *= mult;
+    ++cmp_generation;
+    for (int i=0; i<len_a; ++i) { // remember where each k-gram of A first is
+        hash = hash * mult + cmp_event(&cmp[0], i)->key;
+        if (i >= k-1) {
+            unsigned slot = (unsigned)(hash >> 32) & (2*CMP_MAX_WINDOW-1);
+            while (cmp_table[slot].generation == cmp_generation && cmp_table[slot].hash != hash)
+                slot = (slot+1) & (2*CMP_MAX_WINDOW-1);
+            if (cmp_table[slot].generation != cmp_generation) {
+                cmp_table[slot].generation = cmp_generation;
+                cmp_table[slot].hash = hash;
+                cmp_table[slot].pos = i - (k-1);
+            }
+            hash -= cmp_event(&cmp[0], i-(k-1))->key * power;  // roll it along
+        }
+    }
+    hash = 0;
+    for (int j=0; j<len_b && j-(k-1) < best; ++j) { // look for them in B
+        hash = hash * mult + cmp_event(&cmp[1], j)->key;
+        if (j >= k-1) {
+            unsigned slot = (unsigned)(hash >> 32) & (2*CMP_MAX_WINDOW-1);
+            while (cmp_table[slot].generation == cmp_generation) {
+                if (cmp_table[slot].hash == hash) {
+                    int i = cmp_table[slot].pos, t;
+                    for (t=0; t<k && cmp_event(&cmp[0], i+t)->key == cmp_event(&cmp[1], j-(k-1)+t)->key; ++t) ;
+                    if (t == k && i + j-(k-1) < best) {
+                        best = i + j-(k-1);
+                        *pos_a = i;
+                        *pos_b = j-(k-1);
+                    }
+                    break;
+                }
+                slot = (slot+1) & (2*CMP_MAX_WINDOW-1);
+            }
+            hash -= cmp_event(&cmp[1], j-(k-1))->key * power;
+        }
+    }
+    return best != INT_MAX;
+}
+
+void compare_captures(char *filename_a, char *filename_b) {
+    cmp[0].cap.filename = filename_a;
+    cmp[1].cap.filename = filename_b;
+    record_events = true;
+    for (int s=0; s<2; ++s) {
+        cmp[s].name = 'A' + s;
+        decode_capture(&cmp[s].cap);
+        rewind(cmp[s].cap.pktrecs);
+    }
+    if ((cmpfile = fopen(CMPFILENAME, "a")) == NULL) fatal_err(CMPFILENAME " open failed");
+    fprintf(cmpfile, "\ncompare A: %s, %lu events\n   with B: %s, %lu events\n",
+        filename_a, cmp[0].cap.numpkts, filename_b, cmp[1].cap.numpkts);
+    while (1) {
+        unsigned long long len_a = cmp_available(&cmp[0], 1), len_b = cmp_available(&cmp[1], 1);
+        int pos_a, pos_b, window;
+        bool found = false;
+        if (len_a == 0 && len_b == 0) break;
+        if (len_a > 0 && len_b > 0 && cmp_event(&cmp[0], 0)->key == cmp_event(&cmp[1], 0)->key) {
+            cmp_match();
+            continue;
+        }
+        for (window = CMP_MIN_WINDOW; !found; window *= 2) {
+            found = cmp_find(window, CMP_KGRAM, &pos_a, &pos_b);
+            if (window >= CMP_MAX_WINDOW
+                    || (cmp_available(&cmp[0], window) < window && cmp_available(&cmp[1], window) < window))
+                break;
+        }
+        if (!found) found = cmp_find(window, 1, &pos_a, &pos_b);  // near the end, any one that is the same
+        if (!found) { // nothing is the same in the windows
+            pos_a = (int)cmp_available(&cmp[0], window);
+            pos_b = (int)cmp_available(&cmp[1], window);
+            if (pos_a > window) pos_a = window;
+            if (pos_b > window) pos_b = window;
+        }
+        cmp_differences(pos_a, pos_b);
+    }
+    fprintf(cmpfile, "%lu events the same, %lu missing from B, %lu inserted in B, %lu changed, %lu timing differences\n",
+        cmp_matched, cmp_missing, cmp_inserted, cmp_changed, cmp_timing);
+    fprintf(stderr, "%lu events the same, %lu missing from B, %lu inserted in B, %lu changed, %lu timing differences\n",
+        cmp_matched, cmp_missing, cmp_inserted, cmp_changed, cmp_timing);
+    fprintf(stderr, "compared into " CMPFILENAME "\n");
+    fclose(cmpfile);
+    for (int s=0; s<2; ++s) {
+        fclose(cmp[s].cap.pktrecs);
+        free(cmp[s].cap.data);
+        for (int i=0; i<CMP_RING; ++i) {
+            pool_free(cmp[s].ring[i].data);
+            cmp[s].ring[i].data = NULL;
+        }
+    }
+}
+
+
+//****************** importing old text output ******************
+
+/* Some captures only exist as the packet or command files that earlier
+versions of this program wrote. "spi_decode -i file.pkts.txt file.cmds.txt"
+reads them back and writes the same binary records that new decodes write
+with -b, to file.pkts.bin, so they can be merged and compared like new ones.
+The packet and command files of a capture go into the one file together, in
+time order, with the commands first when the times are the same.
+
+From a packet file we get the packets, "receive enable" lines, and chip
+resets, including the "xmit" and "receive enabl" of the oldest files. From a
+command file we get the command strobes and the config register writes. A
+burst write is put back together from the registers it changed and the
+values of the others we have been following, as one record of all the
+registers, the same as -b writes it. (Register reads and
+FIFO transactions are left out, the same as new decodes leave them out.)
+Times are added up from the times between lines, and from the "pause" lines
+of the oldest command files.
+
+The files can be big, so we read all of one into memory, split it at line
+boundaries into a chunk for each processor, and parse the chunks at the same
+time in separate threads. Each chunk adds up its times from its own start;
+when they are all done, the records are read back in order with the total of
+the chunks before each one added to its times, which is also when the bursts
+are put together, because that needs the registers from before. */
+
+#define IMPORT_MAX_THREADS 32
+#define IMPORT_MIN_CHUNK 65536  // not worth a thread for less than this
+#define IMPORT_BURST_REG (PKT_CONFIG+1)  // a register a burst changed, until the burst is put together
+#define IMPORT_BURST_END (PKT_CONFIG+2)  // the "burst wrote N registers" line: the data is N
+
+struct import_chunk {
+    const char *start, *end;        // the lines to parse
+    bool cmds;                      // a command file, not a packet file
+    struct pkt_record *recs;        // what we found, timed from the start of the chunk
+    unsigned long numrecs, maxrecs;
+    byte *data;                     // the data of all the records, one after the other
+    size_t datalen, maxdata;
+    unsigned long long usec;        // the total time of the chunk
+    unsigned long lines, unknown;
+};
+
+void import_add(struct import_chunk *c, const struct pkt_record *rec, const byte *data) {
+    if (c->numrecs >= c->maxrecs) {
+        c->maxrecs = c->maxrecs ? 2 * c->maxrecs : 1024;
+        if ((c->recs = realloc(c->recs, c->maxrecs * sizeof(*c->recs))) == NULL) fatal_err("out of memory for imported records");
+    }
+    if (c->datalen + rec->length > c->maxdata) {
+        while (c->datalen + rec->length > c->maxdata) c->maxdata = c->maxdata ? 2 * c->maxdata : 16384;
+        if ((c->data = realloc(c->data, c->maxdata)) == NULL) fatal_err("out of memory for imported records");
+    }
+    c->recs[c->numrecs++] = *rec;
+    memcpy(&c->data[c->datalen], data, rec->length);
+    c->datalen += rec->length;
+}
+
+const char *import_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t') ++p;
+    return p;
+}
+
+bool import_word(const char **p, const char *word) {
+    const char *q = import_spaces(*p);
+    size_t len = strlen(word);
+    if (strncmp(q, word, len) != 0) return false;
+    *p = q + len;
+    return true;
+}
+
+bool import_time(const char **p, unsigned long long *usec) {  // seconds with 3 or 6 decimals
+    const char *q = import_spaces(*p);
+    unsigned long long sec = 0, frac = 0;
+    int digits = 0;
+    if (!isdigit((byte)*q)) return false;
+    while (isdigit((byte)*q)) sec = sec * 10 + (*q++ - '0');
+    if (*q++ != '.' || !isdigit((byte)*q)) return false;
+    for ( ; isdigit((byte)*q); ++q) if (digits < 6) {
+            frac = frac * 10 + (*q - '0');
+            ++digits;
+        }
+    while (digits++ < 6) frac *= 10;
+    *usec = sec * 1000000 + frac;
+    *p = q;
+    return true;
+}
+
+int import_hex(const char **p) {  // a two-digit hex byte, or -1
+    const char *q = import_spaces(*p);
+    if (sc_hexval(q[0]) < 0 || sc_hexval(q[1]) < 0 || sc_hexval(q[2]) >= 0) return -1;
+    *p = q + 2;
+    return sc_hexval(q[0]) << 4 | sc_hexval(q[1]);
+}
+
+bool import_chan_sync(const char **p, struct pkt_record *rec) {  // "chan XX sync XX XX"
+    int chan, sync1, sync0;
+    if (!import_word(p, "chan") || (chan = import_hex(p)) < 0 || !import_word(p, "sync")
+            || (sync1 = import_hex(p)) < 0 || (sync0 = import_hex(p)) < 0) return false;
+    rec->chan = (byte)chan;
+    rec->sync1 = (byte)sync1;
+    rec->sync0 = (byte)sync0;
+    return true;
+}
+
+void import_pkts_line(struct import_chunk *c, const char *p) {
+    struct pkt_record rec = {0};
+    byte data[MAX_PKT_LENGTH];
+    unsigned long long usec;
+    int val;
+    if (!import_time(&p, &usec) || !import_word(&p, "sec")) {
+        if (*import_spaces(p) != '\n' && *import_spaces(p) != '\r' && *import_spaces(p) != '\0') ++c->unknown;
+        return;
+    }
+    c->usec += usec;
+    rec.time_usec = c->usec;
+    if (import_word(&p, "rcv enable on") || import_word(&p, "receive enabl")) {
+        rec.type = PKT_RCV_ENABLE;
+        if (!import_chan_sync(&p, &rec)) goto unknown;
+    }
+    else if (import_word(&p, "rset")) rec.type = PKT_RESET;
+    else {
+        if (import_word(&p, "sent") || import_word(&p, "xmit")) rec.type = PKT_SENT;
+        else if (import_word(&p, "rcvd")) rec.type = PKT_RCVD;
+        else goto unknown;
+        while (isdigit((byte)*import_spaces(p))) p = import_spaces(p) + 1;  // the length, which we count ourselves
+        if (!import_word(&p, "bytes") || !import_chan_sync(&p, &rec) || !import_word(&p, "data")) goto unknown;
+        while (rec.length < MAX_PKT_LENGTH && (val = import_hex(&p)) >= 0) data[rec.length++] = (byte)val;
+    }
+    import_add(c, &rec, data);
+    return;
+unknown:
+    ++c->unknown;
+}
+
+void import_cmds_line(struct import_chunk *c, const char *p) {
+    struct pkt_record rec = {0};
+    byte data[2];
+    unsigned long long usec;
+    int reg, val;
+    bool burst;
+    if (*import_spaces(p) == '*') return;  // a "***" line about bad data, which never has a command after it
+    if (import_word(&p, "burst write without chip selected at reg")) import_hex(&p);  // runs into the line it is about
+    if (import_time(&p, &usec)) c->usec += usec;
+    rec.time_usec = c->usec;
+    if (import_word(&p, "command")) {
+        if ((reg = import_hex(&p)) < 0x30 || reg > 0x3d) return;
+        rec.type = PKT_STROBE;
+        rec.length = 1;
+        data[0] = (byte)reg;
+        import_add(c, &rec, data);
+    }
+    else if (import_word(&p, "burst wrote")) {  // the end of a burst, after the registers it changed
+        for (p = import_spaces(p), val = 0; isdigit((byte)*p); ++p) val = val * 10 + (*p - '0');
+        rec.type = IMPORT_BURST_END;
+        rec.length = 1;
+        data[0] = (byte)(val > 64 ? 64 : val);
+        import_add(c, &rec, data);
+    }
+    else if ((burst = import_word(&p, "wrote")) || import_word(&p, "write")) {  // "wrote": a register a burst changed
+        if ((reg = import_hex(&p)) < 0 || reg > 0x2e) return;  // not a config register
+        while (*p != '\n' && *p != '\0' && strncmp(p, ") as ", 5) != 0) ++p;
+        if (*p == '\n' || *p == '\0') return;
+        p += 4;
+        if ((val = import_hex(&p)) < 0) return;
+        rec.type = burst ? IMPORT_BURST_REG : PKT_CONFIG;
+        rec.length = 2;
+        data[0] = (byte)reg;
+        data[1] = (byte)val;
+        import_add(c, &rec, data);
+    }
+    else if (import_word(&p, "pause") && import_time(&p, &usec)) c->usec += usec;
+}
+
+DWORD WINAPI import_thread(void *arg) {
+    struct import_chunk *c = arg;
+    const char *p = c->start, *eol;
+    while (p < c->end) {
+        if ((eol = memchr(p, '\n', c->end - p)) == NULL) eol = c->end;
+        ++c->lines;
+        if (c->cmds) import_cmds_line(c, p);
+        else import_pkts_line(c, p);
+        p = eol + 1;
+    }
+    return 0;
+}
+
+struct import_source {  // one of the text files of a capture, parsed
+    char *filename;
+    struct import_chunk chunks[IMPORT_MAX_THREADS];
+    int numchunks;
+    size_t len;
+    int chunk;                      // where we are in reading its records back in order
+    unsigned long rec;
+    size_t dataoffset;
+    unsigned long long offset;      // the total time of the chunks before this one
+    byte config[0x2f];              // the config registers so far, as the command file showed them
+    int burst_start[65];            // the first register of the last burst of each length, or -1
+} import_sources[2];
+
+bool import_parse(struct import_source *s) {  // read the file and parse its chunks in parallel
+    HANDLE threads[IMPORT_MAX_THREADS];
+    SYSTEM_INFO sysinfo;
+    char *text;
+    FILE *file;
+    size_t len;
+    int numchunks;
+
+    if ((file = fopen(s->filename, "rb")) == NULL) {
+        fprintf(stderr, "%s open for read failed\n", s->filename);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    rewind(file);
+    if ((text = malloc(len + 1)) == NULL) fatal_err("out of memory for the file to import");
+    len = fread(text, 1, len, file);
+    text[len] = '\0';
+    fclose(file);
+
+    GetSystemInfo(&sysinfo);
+    numchunks = sysinfo.dwNumberOfProcessors;
+    if (numchunks > IMPORT_MAX_THREADS) numchunks = IMPORT_MAX_THREADS;
+    if ((size_t)numchunks > len / IMPORT_MIN_CHUNK + 1) numchunks = (int)(len / IMPORT_MIN_CHUNK + 1);
+    if (numchunks < 1) numchunks = 1;
+    for (int i=0; i<numchunks; ++i) {  // split at the ends of lines
+        struct import_chunk *c = &s->chunks[i];
+        const char *end = text + len * (i+1) / numchunks;
+        memset(c, 0, sizeof(*c));
+        c->start = i == 0 ? text : s->chunks[i-1].end;
+        if (end < c->start) end = c->start;
+        while (end < text + len && end[-1] != '\n') ++end;
+        c->end = end;
+        c->cmds = strstr(s->filename, ".cmds") != NULL;
+    }
+    for (int i=0; i<numchunks; ++i)
+        if ((threads[i] = CreateThread(NULL, 0, import_thread, &s->chunks[i], 0, NULL)) == NULL)
+            fatal_err("can't start an import thread");
+    for (int i=0; i<numchunks; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    free(text);
+    s->numchunks = numchunks;
+    s->len = len;
+    s->chunk = 0;
+    s->rec = 0;
+    s->dataoffset = 0;
+    s->offset = 0;
+    memset(s->config, 0, sizeof(s->config));
+    for (int i=0; i<65; ++i) s->burst_start[i] = -1;
+    return true;
+}
+
+const struct pkt_record *import_peek(struct import_source *s, const byte **data) {
+    // the next record of the file with its time from the start of the file, or NULL at the end
+    static struct pkt_record rec;
+    while (s->chunk < s->numchunks) {
+        struct import_chunk *c = &s->chunks[s->chunk];
+        if (s->rec < c->numrecs) {
+            rec = c->recs[s->rec];
+            rec.time_usec += s->offset;
+            *data = &c->data[s->dataoffset];
+            return &rec;
+        }
+        s->offset += c->usec;
+        ++s->chunk;
+        s->rec = 0;
+        s->dataoffset = 0;
+    }
+    return NULL;
+}
+
+void import_skip(struct import_source *s) {
+    s->dataoffset += s->chunks[s->chunk].recs[s->rec].length;
+    ++s->rec;
+}
+
+void import_burst(struct import_source *s, struct pkt_record *rec, byte *data) {
+    /* Put a burst config write back together from the " wrote" lines of the
+    registers it changed and the "burst wrote N registers" line after them. A
+    command file doesn't say which register a burst started at, so we take the
+    only start that fits the registers that changed, or else the start of the
+    last burst of the same length that fits, or else the first register that
+    changed. The registers that didn't change get the values we have been
+    following. Older command files never showed the last register of a burst,
+    so for them it also gets the value we have been following, which may not
+    be what was written. */
+    const byte *d;
+    const struct pkt_record *r;
+    byte changed[0x2f][2];
+    int numchanged = 0, count = 0, lo, hi, start;
+    *rec = *import_peek(s, &d);
+    while ((r = import_peek(s, &d)) != NULL && r->type == IMPORT_BURST_REG) {
+        if (numchanged < 0x2f) {
+            changed[numchanged][0] = d[0];
+            changed[numchanged++][1] = d[1];
+        }
+        import_skip(s);
+    }
+    if (r != NULL && r->type == IMPORT_BURST_END) {
+        rec->time_usec = r->time_usec;
+        count = d[0];
+        import_skip(s);
+    }
+    else count = changed[numchanged-1][0] - changed[0][0] + 1;  // no end line: what the registers span
+    lo = 0;
+    hi = 0x2f - count;
+    for (int i=0; i<numchanged; ++i) {
+        if (changed[i][0] + 1 - count > lo) lo = changed[i][0] + 1 - count;
+        if (changed[i][0] < hi) hi = changed[i][0];
+    }
+    if (lo > hi) hi = lo = numchanged ? changed[0][0] : 0;  // the lines don't make sense
+    if (s->burst_start[count] >= lo && s->burst_start[count] <= hi) start = s->burst_start[count];
+    else start = numchanged ? hi : lo;
+    s->burst_start[count] = start;
+    for (int i=0; i<numchanged; ++i) s->config[changed[i][0]] = changed[i][1];
+    rec->type = PKT_CONFIG;
+    rec->length = count + 1;
+    data[0] = (byte)start;
+    for (int i=0; i<count; ++i) data[1+i] = start+i < 0x2f ? s->config[start+i] : 0;
+}
+
+bool import_next(struct import_source *s, struct pkt_record *rec, byte **data) {
+    // the next record of the file, in order, with the bursts put back together
+    static byte burst[66];
+    const byte *d;
+    const struct pkt_record *r = import_peek(s, &d);
+    if (r == NULL) return false;
+    if (r->type == IMPORT_BURST_REG || r->type == IMPORT_BURST_END) {
+        import_burst(s, rec, burst);
+        *data = burst;
+    }
+    else {
+        *rec = *r;
+        *data = (byte *)d;
+        if (r->type == PKT_CONFIG) s->config[d[0]] = d[1];
+        import_skip(s);
+    }
+    if (rec->type == PKT_STROBE || rec->type == PKT_CONFIG) {  // what -b would have recorded
+        rec->chan = s->config[0x0A];
+        rec->sync1 = s->config[0x04];
+        rec->sync0 = s->config[0x05];
+    }
+    return true;
+}
+
+void import_capture_name(const char *filename, char *name, size_t size) {
+    // the file name without .txt, .pkts, or .cmds
+    char *ext;
+    strlcpy(name, filename, size);
+    if ((ext = strrchr(name, '.')) != NULL && strcmp(ext, ".txt") == 0) *ext = '\0';
+    if ((ext = strrchr(name, '.')) != NULL && (strcmp(ext, ".pkts") == 0 || strcmp(ext, ".cmds") == 0)) *ext = '\0';
+}
+
+void import_capture(char *filename_a, char *filename_b) {
+    // import one capture's packet file, command file, or both, into one .bin file
+    char binname[MAX_PATH];
+    FILE *file;
+    int numfiles = filename_b ? 2 : 1;
+    unsigned long lines = 0, unknown = 0, records = 0;
+    unsigned long long start = now_usec(), usec;
+    size_t len = 0;
+    struct pkt_record recs[2];
+    byte *data[2];
+    bool more[2] = {false, false};
+
+    import_sources[0].filename = filename_a;
+    import_sources[1].filename = filename_b;
+    for (int f=0; f<numfiles; ++f) if (!import_parse(&import_sources[f])) return;
+
+    import_capture_name(filename_a, binname, sizeof(binname) - 10);
+    strlcat(binname, ".pkts.bin", sizeof(binname));  // the name -b uses for packets and commands
+    if ((file = fopen(binname, "wb")) == NULL) fatal_err("can't open the binary records file for write");
+    for (int f=0; f<numfiles; ++f) more[f] = import_next(&import_sources[f], &recs[f], &data[f]);
+    while (more[0] || more[1]) {  // in time order; commands first when the times are the same
+        int f = !more[1] || (more[0] && (recs[0].time_usec < recs[1].time_usec
+                || (recs[0].time_usec == recs[1].time_usec && import_sources[0].chunks[0].cmds))) ? 0 : 1;
+        write_pkt_record(file, &recs[f], data[f]);
+        ++records;
+        more[f] = import_next(&import_sources[f], &recs[f], &data[f]);
+    }
+    fclose(file);
+    for (int f=0; f<numfiles; ++f) {
+        struct import_source *s = &import_sources[f];
+        for (int i=0; i<s->numchunks; ++i) {
+            lines += s->chunks[i].lines;
+            unknown += s->chunks[i].unknown;
+            free(s->chunks[i].recs);
+            free(s->chunks[i].data);
+        }
+        len += s->len;
+    }
+    usec = now_usec() - start;
+    fprintf(stderr, "%s%s%s: %lu lines, %lu records into %s, %lu lines not understood, %d threads, %.1f MB/sec\n",
+        filename_a, filename_b ? " and " : "", filename_b ? filename_b : "", lines, records, binname, unknown,
+        numfiles > 1 && import_sources[1].numchunks > import_sources[0].numchunks ? import_sources[1].numchunks
+        : import_sources[0].numchunks, len / (usec + 1.0));
+}
+
+void import_files(int numfiles, char *filenames[]) {
+    // the packet and command files of the same capture go together into one file
+    char name_a[MAX_PATH], name_b[MAX_PATH];
+    bool *done = calloc(numfiles, sizeof(bool));
+    if (done == NULL) fatal_err("out of memory");
+    for (int i=0; i<numfiles; ++i) {
+        int partner = -1;
+        if (done[i]) continue;
+        import_capture_name(filenames[i], name_a, sizeof(name_a));
+        for (int j=i+1; j<numfiles && partner < 0; ++j) {
+            import_capture_name(filenames[j], name_b, sizeof(name_b));
+            if (!done[j] && strcmp(name_a, name_b) == 0) partner = j;
+        }
+        if (partner >= 0) done[partner] = true;
+        import_capture(filenames[i], partner >= 0 ? filenames[partner] : NULL);
+    }
+    free(done);
+}
+
+
+//***************** input *************************
+
+void end_of_file(void) {
+    drop_held_text();
+    packet_flush();
+    if (low_latency && fileread) replay_send(replay.event_usec + SNIFFER_IDLE_USEC);  // what it has left
+    output("***end of file");
+    fprintf(stderr, "***end of file");
+    show_latency();
+    show_classes();
+    show_radio();
+    show_histograms();
+    show_reassembly();
+    show_bad_data();
+    cleanup();
+    exit(0);
+}
+
+/* In low latency mode we decode whatever complete transactions have arrived,
+and keep the rest until the next read. When reading a file we replay it in
+USB packet sized pieces, as a stand-in for the serial port.
+
+A transaction that is only a register address, like "[t5.F810]", isn't
+complete: some recordings have the value after the unselect, as in
+"[t5.F810]t6.0010[", and the decoder reads on past the ']' to get it. So we
+only stop after a transaction that stands by itself, and otherwise just
+before its '['. */
+
+int pending = 0;  // undecoded characters at the start of rawline
+
+bool transaction_complete(const char *start, const char *end) {  // the data between [ and ]
+    int digits = 0, first = 0;
+    for (const char *p = start; p < end; ++p) {
+        if (*p == 't' || *p == 'k' || *p == 'K' || *p == 'w')  // a number, not data
+        {
+            while (p + 1 < end && isdigit((byte)p[1])) ++p;
+            if (p + 1 < end && p[1] == '.') ++p;
+        }
+        else if (*p == 'r' || *p == 'h') return true;  // compressed: a run or a repeat
+        else if (isxdigit((byte)*p) && ++digits <= 2) first = (first << 4) | sc_hexval(*p);
+    }
+    if (digits != 4) return true;  // nothing, or an address and data
+    return !(first & 0x40) && (first & 0x3f) >= 0x30 && (first & 0x3f) <= 0x3d;  // only a command strobe
+}
+
+void decode_pending(char *buf, int *numpending) {  // decode the complete transactions, and keep the rest
+    char *end, *start, saved;
+    int len;
+    buf[*numpending] = '\0';
+    end = strrchr(buf, ']'); // the end of the last complete transaction
+    if (end != NULL) {
+        for (start = end; start > buf && *start != '['; --start) ;
+        if (*start == '[' && !transaction_complete(start + 1, end)) {  // stop before it instead
+            end = start - 1;
+            if (end < buf) end = NULL;
+        }
+    }
+    if (end == NULL) {
+        if (*numpending < MAX_LINE/2) return;
+        end = &buf[*numpending-1];  // that's too long to wait: decode what we have
+    }
+    len = end - buf + 1;
+    saved = buf[len];
+    buf[len] = '\0';
+    if (!fileread) fprintf(datfile, "%s\n", buf);
+    decode_input(buf, len);
+    fflush(outfile);
+    buf[len] = saved;
+    *numpending -= len;
+    memmove(buf, &buf[len], *numpending + 1);
+}
+
+void low_latency_input(void) {
+    DWORD got;
+    if (fileread) {
+        if (replay.decode_start == 0) replay.decode_start = now_usec();
+        got = fread(&rawline[pending], 1, REPLAY_CHUNK, datfile);
+        if (got == 0) {
+            if (pending > 0) decode_input(rawline, pending);
+            end_of_file();
+        }
+    }
+    else ReadFile(handle_serial, &rawline[pending], MAX_LINE-1-pending, &got, NULL);
+    if (got == 0) return;
+    chunk_arrival_usec = now_usec();
+    pending += got;
+    decode_pending(rawline, &pending);
+}
+
+
+//***************** watching several Sniffers at once *************************
+
+/* With -w one program watches several Sniffers live, each on its own serial
+port. The main thread waits for input on all the ports at once, with epoll on
+Linux and by polling on Windows, and stamps each chunk it reads with the time
+from one monotonic clock, so the times of all the ports can be compared. It
+puts the chunks into a queue, and a single writer thread takes them out in
+order and does all the decoding and writing, so a slow disk or a long decode
+doesn't delay the stamping.
+
+Each port has its own decoder state and its own files: the port "COM7" or
+"/dev/ttyACM1" is decoded into spi_COM7.cmds.txt and spi_ttyACM1.pkts.txt and
+so on, and its raw input is appended to spi_COM7.dat. Before decoding a chunk
+the writer thread swaps in the state of the chunk's port. The packets of all
+the ports also go to LIVEFILENAME, with the port and the time they arrived at
+the PC, on the shared clock. As in the -l mode, we decode each transaction as
+soon as all of it has arrived.
+
+The queue has one writer and one reader, so it needs no locks: the main
+thread only moves the head, and the writer thread only moves the tail. */
+
+#define MAX_PORTS 16
+#define QUEUE_CHUNKS 1024      // a power of 2
+#define QUEUE_CHUNK_SIZE 4096  // the most we read from a port at once
+
+struct port {
+    char *name;
+    char tag[40];        // for the file names and the timeline
+    HANDLE handle;       // INVALID_HANDLE_VALUE once it has closed
+    char *input;         // what has arrived but isn't decoded yet
+    int numpending;
+    byte *state;         // its decoder state, while another port's is in use
+    unsigned long long last_arrival_usec;
+    unsigned long chunks;
+    unsigned long long chars;
+    unsigned long long radio_usec, airtime_usec;  // what -t found about its device
+    double rx_duty, energy_mj;
+} ports[MAX_PORTS];
+int numports;
+
+struct chunk {
+    struct port *port;
+    unsigned long long arrival_usec;
+    int len;             // 0 when the port has closed
+    char data[QUEUE_CHUNK_SIZE];
+} queue[QUEUE_CHUNKS];
+volatile unsigned long queue_head, queue_tail;  // chunks put in and taken out
+volatile bool watching;
+unsigned long queue_full_waits;
+
+struct {  // everything the decoder remembers from one chunk to the next
+    void *addr;
+    size_t size;
+} decoder_state[] = {
+    {&packet, sizeof(packet)}, {&expander, sizeof(expander)},
+    {held_text, sizeof(held_text)}, {&held_len, sizeof(held_len)},
+    {current_config_regs, sizeof(current_config_regs)}, {new_config_regs, sizeof(new_config_regs)},
+    {config_written, sizeof(config_written)}, {&cmd_delta_time, sizeof(cmd_delta_time)},
+    {&capture_time_usec, sizeof(capture_time_usec)}, {&chip_selected, sizeof(chip_selected)},
+    {&awaiting_select, sizeof(awaiting_select)}, {&last_txn_known, sizeof(last_txn_known)},
+    {&srx_pending, sizeof(srx_pending)}, {&stx_pending, sizeof(stx_pending)},
+    {&last_txn_usec, sizeof(last_txn_usec)}, {&srx_usec, sizeof(srx_usec)}, {&stx_usec, sizeof(stx_usec)},
+    {&cycle_hz, sizeof(cycle_hz)}, {&capture_cycles, sizeof(capture_cycles)},
+    {&event_ns, sizeof(event_ns)}, {&cmd_delta_ns, sizeof(cmd_delta_ns)}, {&txn_timing, sizeof(txn_timing)},
+    {&radio, sizeof(radio)}, {&datfile, sizeof(datfile)}, {&outfile, sizeof(outfile)},
+    {&pktfile, sizeof(pktfile)}, {&pktrecfile, sizeof(pktrecfile)}, {&radfile, sizeof(radfile)},
+    {&live_port, sizeof(live_port)}
+};
+#define DECODER_STATE_ITEMS (sizeof(decoder_state) / sizeof(decoder_state[0]))
+size_t decoder_state_size;
+struct port *current_port = NULL;  // whose state is in use, or NULL for the state we started with
+byte *home_state;
+
+void save_decoder(byte *state) {
+    for (unsigned i=0; i<DECODER_STATE_ITEMS; ++i) {
+        memcpy(state, decoder_state[i].addr, decoder_state[i].size);
+        state += decoder_state[i].size;
+    }
+}
+
+void switch_decoder(struct port *p) {  // to the state of port p
+    byte *state;
+    if (p == current_port) return;
+    save_decoder(current_port ? current_port->state : home_state);
+    state = p ? p->state : home_state;
+    for (unsigned i=0; i<DECODER_STATE_ITEMS; ++i) {
+        memcpy(decoder_state[i].addr, state, decoder_state[i].size);
+        state += decoder_state[i].size;
+    }
+    current_port = p;
+}
+
+FILE *open_port_file(struct port *p, char *suffix, char *mode) {
+    char filename[MAX_PATH];
+    FILE *file;
+    snprintf(filename, sizeof(filename), "spi_%s%s", p->tag, suffix);
+    if ((file = fopen(filename, mode)) == NULL) {
+        fprintf(stderr, "%s open failed\n", filename);
+        cleanup();
+        exit(98);
+    }
+    return file;
+}
+
+void open_watched_port(struct port *p, char *name) {
+    char dev_name[MAX_PATH], *tag = name;
+    p->name = name;
+    if (strncmp(tag, "/dev/", 5) == 0) tag += 5;
+    if (strncmp(tag, "\\\\.\\", 4) == 0) tag += 4;
+    strlcpy(p->tag, tag, sizeof(p->tag));
+    for (char *t = p->tag; *t; ++t) if (*t == '/' || *t == '\\' || *t == ':') *t = '_';
+#ifdef _WIN32
+    if (strchr(name, '\\') == NULL) snprintf(dev_name, sizeof(dev_name), "\\\\.\\%s", name);
+    else
+#endif
+        strlcpy(dev_name, name, sizeof(dev_name));
+    timeouts.ReadIntervalTimeout = MAXDWORD;  // return at once with whatever has arrived
+    timeouts.ReadTotalTimeoutMultiplier = 0;
+    timeouts.ReadTotalTimeoutConstant = 0;
+    p->handle = open_serial_port(dev_name);
+    if ((p->input = malloc(MAX_LINE)) == NULL || (p->state = malloc(decoder_state_size)) == NULL)
+        fatal_err("out of memory for the ports");
+    p->numpending = 0;
+
+    save_decoder(p->state);  // start from a decoder that hasn't seen anything
+    switch_decoder(p);
+    datfile = open_port_file(p, ".dat", "a");
+    outfile = open_port_file(p, ".cmds.txt", "a");
+    pktfile = open_port_file(p, ".pkts.txt", "a");
+    fprintf(pktfile, "\n");
+    if (write_records) pktrecfile = open_port_file(p, ".pkts.bin", "wb");
+    if (track_radio) {
+        radfile = open_port_file(p, ".radio.txt", "a");
+        fprintf(radfile, "\n");
+    }
+    live_port = p->tag;
+    switch_decoder(NULL);
+}
+
+void close_watched_port(struct port *p) {  // decode the rest, and show what we know about it
+    switch_decoder(p);
+    chunk_arrival_usec = p->last_arrival_usec;
+    if (p->numpending > 0) {
+        fprintf(datfile, "%s\n", p->input);
+        decode_input(p->input, p->numpending);
+        p->numpending = 0;
+    }
+    drop_held_text();
+    packet_flush();
+    if (low_latency && fileread) replay_send(replay.event_usec + SNIFFER_IDLE_USEC);  // what it has left
+    fprintf(stderr, "\n%s: %llu chars in %lu chunks\n", p->name, p->chars, p->chunks);
+    output("\n%llu chars in %lu chunks\n", p->chars, p->chunks);
+    show_radio();
+    p->radio_usec = radio.total_usec;
+    p->airtime_usec = radio.state_usec[RADIO_TX];
+    p->rx_duty = radio.total_usec ? radio.rx_equivalent_usec / radio.total_usec : 0;
+    p->energy_mj = radio.energy_mj;
+    fclose(datfile);
+    fclose(outfile);
+    fclose(pktfile);
+    if (pktrecfile) fclose(pktrecfile);
+    if (radfile) fclose(radfile);
+    datfile = outfile = pktfile = pktrecfile = radfile = NULL;
+    pool_free(packet.data);
+    packet.data = NULL;
+    switch_decoder(NULL);
+}
+
+void show_device_energy(void) {  // from following the radio of each device being watched
+    bool any = false;
+    for (int i=0; i<numports; ++i) if (ports[i].radio_usec) any = true;
+    if (!track_radio || !any) return;
+    for (int pass = 0; pass < 2; ++pass) {  // to the console, and to the live file
+        FILE *file = pass == 0 ? stderr : livefile;
+        fprintf(file, "\nradio of each device:\n  %-12s %12s %12s %9s %12s %10s\n",
+            "device", "sec", "airtime sec", "RX duty", "energy mJ", "average mA");
+        for (int i=0; i<numports; ++i) if (ports[i].radio_usec) {
+                struct port *p = &ports[i];
+                fprintf(file, "  %-12s %12.6f %12.6f %8.3f%% %12.3f %10.4f\n", p->tag, p->radio_usec/1e6,
+                    p->airtime_usec/1e6, 100.0*p->rx_duty, p->energy_mj, p->energy_mj / SUPPLY_VOLTS / (p->radio_usec/1e6));
+            }
+    }
+}
+
+DWORD WINAPI watch_writer(void *param) {  // decode the chunks in the queue, in order
+    while (1) {
+        bool more = watching;
+        struct chunk *c;
+        MemoryBarrier();
+        if (queue_tail == queue_head) {
+            if (!more) break;
+            Sleep(1);
+            continue;
+        }
+        c = &queue[queue_tail % QUEUE_CHUNKS];
+        if (c->len == 0) close_watched_port(c->port);
+        else {
+            struct port *p = c->port;
+            switch_decoder(p);
+            chunk_arrival_usec = p->last_arrival_usec = c->arrival_usec;
+            memcpy(&p->input[p->numpending], c->data, c->len);
+            p->numpending += c->len;
+            decode_pending(p->input, &p->numpending);
+        }
+        MemoryBarrier();
+        ++queue_tail;
+    }
+    return 0;
+}
+
+bool watch_read(struct port *p) {  // read what has arrived on a port into the queue; false if nothing
+    struct chunk *c;
+    DWORD got;
+    while (queue_head - queue_tail >= QUEUE_CHUNKS) {  // the writer thread is behind
+        ++queue_full_waits;
+        Sleep(1);
+    }
+    c = &queue[queue_head % QUEUE_CHUNKS];
+    if (!ReadFile(p->handle, c->data, QUEUE_CHUNK_SIZE, &got, NULL)) {  // it has gone away
+        fprintf(stderr, "%s has closed\n", p->name);
+        CloseHandle(p->handle);
+        p->handle = INVALID_HANDLE_VALUE;
+        got = 0;
+    }
+    else if (got == 0) return false;
+    else {
+        c->arrival_usec = now_usec();
+        ++p->chunks;
+        p->chars += got;
+    }
+    c->port = p;
+    c->len = (int)got;
+    MemoryBarrier();
+    ++queue_head;
+    return true;
+}
+
+void watch_ports(int count, char *names[]) {
+    HANDLE writer;
+    int open_ports;
+#ifdef __linux__
+    struct epoll_event events[MAX_PORTS];
+    int epoll_fd;
+    if ((epoll_fd = epoll_create1(0)) < 0) fatal_err("can't create the epoll instance\n");
+#endif
+    if (count > MAX_PORTS) fatal_err("too many ports to watch\n");
+    for (unsigned i=0; i<DECODER_STATE_ITEMS; ++i) decoder_state_size += decoder_state[i].size;
+    if ((home_state = malloc(decoder_state_size)) == NULL) fatal_err("out of memory for the ports");
+    low_latency = true;
+    for (numports=0; numports<count; ++numports) {
+        open_watched_port(&ports[numports], names[numports]);
+#ifdef __linux__
+        events[0].events = EPOLLIN;
+        events[0].data.ptr = &ports[numports];
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, posix_fd(ports[numports].handle), &events[0]) != 0)
+            fatal_err("can't watch the port with epoll\n");
+#endif
+    }
+    if ((livefile = fopen(LIVEFILENAME, "a")) == NULL) fatal_err(LIVEFILENAME " open failed");
+    fprintf(livefile, "\n");
+    live_start_usec = now_usec();
+    watching = true;
+    if ((writer = CreateThread(NULL, 0, watch_writer, NULL, 0, NULL)) == NULL)
+        fatal_err("can't start the writer thread");
+    fprintf(stderr, "Watching %d ports.\n", numports);
+
+    open_ports = numports;
+    while (open_ports > 0 && !kbhit()) {
+#ifdef __linux__
+        int ready = epoll_wait(epoll_fd, events, MAX_PORTS, 100);  // return now and then to check the keyboard
+        for (int i=0; i<ready; ++i) {
+            struct port *p = events[i].data.ptr;
+            if (watch_read(p) && p->handle == INVALID_HANDLE_VALUE) --open_ports;
+        }
+#else
+        bool got_any = false;
+        for (int i=0; i<numports; ++i) {
+            struct port *p = &ports[i];
+            if (p->handle == INVALID_HANDLE_VALUE) continue;
+            if (watch_read(p)) {
+                got_any = true;
+                if (p->handle == INVALID_HANDLE_VALUE) --open_ports;
+            }
+        }
+        if (!got_any) Sleep(1);
+#endif
+    }
+    for (int i=0; i<numports; ++i) {  // the ones that are still open, if a key was pressed
+        struct port *p = &ports[i];
+        if (p->handle == INVALID_HANDLE_VALUE) continue;
+        CloseHandle(p->handle);
+        p->handle = INVALID_HANDLE_VALUE;
+        while (queue_head - queue_tail >= QUEUE_CHUNKS) Sleep(1);
+        queue[queue_head % QUEUE_CHUNKS].port = p;
+        queue[queue_head % QUEUE_CHUNKS].len = 0;
+        MemoryBarrier();
+        ++queue_head;
+    }
+    watching = false;
+    WaitForSingleObject(writer, INFINITE);
+    CloseHandle(writer);
+#ifdef __linux__
+    close(epoll_fd);
+#endif
+    for (int i=0; i<numports; ++i) free(ports[i].input);
+    if (queue_full_waits) fprintf(stderr, "\nthe writer thread fell behind %lu times\n", queue_full_waits);
+    show_latency();
+    show_classes();
+    show_device_energy();
+    show_histograms();
+    show_reassembly();
+    show_bad_data();
+    fclose(livefile);
+    livefile = NULL;
+}
+
+
+//***************** testing with damaged input *************************
+
+/* With -xn we check that bad input can't stop the decoder, and see how fast it
+is. We decode the input file once as it is, and then n times with the kinds of
+damage a noisy serial connection does: changed characters, dropped and repeated
+pieces, and bursts of garbage. Round r uses srand(r), so a problem can be
+reproduced. Nothing is written to the output files. */
+
+#define FUZZ_RATE 500   // about one damaged place in this many characters
+#define FUZZ_CHARS "0123456789ABCDEF[]tw.!rh \r\n"
+
+void fuzz_decode(char *input, size_t len) {  // decode a whole file that is in memory
+    reset_decoder();
+    awaiting_select = false;
+    for (size_t pos = 0; pos < len; ) {
+        size_t n = 0;
+        while (pos + n < len && n < MAX_LINE-1 && input[pos + n++] != '\n') ;
+        memcpy(rawline, &input[pos], n);
+        rawline[n] = '\0';
+        decode_input(rawline, n);
+        pos += n;
+    }
+}
+
+size_t fuzz_damage(const char *input, size_t len, char *out, size_t maxlen, unsigned long *damaged, unsigned long *changed) {
+    size_t outlen = 0, pos = 0;
+    while (pos < len && outlen + 64 < maxlen) {
+        int size = 1 + rand() % 32;
+        if (rand() % FUZZ_RATE != 0) {
+            out[outlen++] = input[pos++];
+            continue;
+        }
+        ++*damaged;
+        switch (rand() % 5) {
+        case 0: // a likely character
+            out[outlen] = FUZZ_CHARS[rand() % (sizeof(FUZZ_CHARS)-1)];
+            if (out[outlen++] != input[pos++]) ++*changed;
+            break;
+        case 1: // any character
+            out[outlen] = (char)(1 + rand() % 255);
+            if (out[outlen++] != input[pos++]) ++*changed;
+            break;
+        case 2: // lost characters
+            if ((size_t)size > len - pos) size = len - pos;
+            pos += size;
+            *changed += size;
+            break;
+        case 3: // repeated characters
+            if ((size_t)size > outlen) size = outlen;
+            memcpy(&out[outlen], &out[outlen - size], size);
+            outlen += size;
+            *changed += size;
+            break;
+        case 4: // garbage
+            *changed += size;
+            while (size--) out[outlen++] = FUZZ_CHARS[rand() % (sizeof(FUZZ_CHARS)-1)];
+        }
+    }
+    return outlen;
+}
+
+unsigned long total_bad_data(void) {
+    unsigned long total = 0;
+    for (int i=0; i<BAD_REASONS; ++i) total += bad_data_count[i];
+    return total;
+}
+
+void fuzz_decoder(int rounds) {
+    FILE *file;
+    char *input, *damaged_input;
+    size_t len, maxlen;
+    unsigned long long start, usec, total_usec = 0, total_chars = 0;
+
+    if ((file = fopen(datfilename, "rb")) == NULL) fatal_err("input file open for read failed\n");
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    rewind(file);
+    maxlen = len * 2 + 1000;
+    if ((input = malloc(len + 1)) == NULL || (damaged_input = malloc(maxlen)) == NULL)
+        fatal_err("out of memory for the input file\n");
+    len = fread(input, 1, len, file);
+    fclose(file);
+    for (size_t i=0; i<len; ++i) if (input[i] == '\0') input[i] = ' ';
+
+    start = now_usec();
+    fuzz_decode(input, len);
+    usec = now_usec() - start;
+    fprintf(stderr, "undamaged: %lu chars, %.1f MB/sec, %lu bad data\n",
+        (unsigned long)len, len / (usec + 1.0), total_bad_data());
+    for (int round=1; round<=rounds; ++round) {
+        unsigned long damaged = 0, changed = 0, bad_before = total_bad_data();
+        unsigned long long skipped_before = chars_skipped;
+        size_t damaged_len;
+        srand(round);
+        damaged_len = fuzz_damage(input, len, damaged_input, maxlen, &damaged, &changed);
+        start = now_usec();
+        fuzz_decode(damaged_input, damaged_len);
+        usec = now_usec() - start;
+        total_usec += usec;
+        total_chars += damaged_len;
+        fprintf(stderr, "round %d: %lu chars, %lu changed, lost, or added in %lu places, %.1f MB/sec, %lu bad data, %llu chars skipped\n",
+            round, (unsigned long)damaged_len, changed, damaged, damaged_len / (usec + 1.0),
+            total_bad_data() - bad_before, chars_skipped - skipped_before);
+    }
+    if (rounds > 0) fprintf(stderr, "%d damaged rounds decoded without stopping, %.1f MB/sec\n",
+            rounds, total_chars / (total_usec + 1.0));
+    show_bad_data();
+    free(input);
+    free(damaged_input);
+}
+
+
+//***************** main loop *************************
+
+
+int main(int argc,char *argv[]) {
+    int argno;
+
+    fprintf(stderr, "SPI decoder, V%s\n", VERSION);
+
+    argno = HandleOptions(argc,argv);
+    if (sigfilename) load_signatures();
+    if (histfilename) load_histograms();
+
+    if (merge) {
+        if (argno == 0 || argc - argno < 2) fatal_err("merging needs at least two capture files\n");
+        if ((outfile = fopen(OUTFILENAME,"a")) == NULL) fatal_err(OUTFILENAME " open failed");
+        merge_captures(argc - argno, &argv[argno]);
+        show_classes();
+        cleanup();
+        return 0;
+    }
+    if (import) {
+        if (argno == 0) fatal_err("importing needs files to import\n");
+        import_files(argc - argno, &argv[argno]);
+        return 0;
+    }
+    if (compare) {
+        if (argno == 0 || argc - argno != 2) fatal_err("comparing needs two capture files\n");
+        if ((outfile = fopen(OUTFILENAME,"a")) == NULL) fatal_err(OUTFILENAME " open failed");
+        compare_captures(argv[argno], argv[argno+1]);
+        cleanup();
+        return 0;
+    }
+    if (watch) {
+        if (argno == 0) fatal_err("watching needs the serial ports to watch\n");
+        if ((outfile = fopen(OUTFILENAME,"a")) == NULL) fatal_err(OUTFILENAME " open failed");
+        watch_ports(argc - argno, &argv[argno]);
+        cleanup();
+        return 0;
+    }
+    if (argno > 0) datfilename = argv[argno];
+    if (fuzz_rounds > 0) {
+        fuzz_decoder(fuzz_rounds);
+        return 0;
+    }
+
+    if (fileread) {
+        if ((datfile = fopen(datfilename,"r")) == NULL) // opne to read from .dat file
+            fatal_err("input file open for read failed");
+        fprintf(stderr, "Reading from %s\n", datfilename);
+    }
+    else {
+        char dev_name[80];
+#ifdef _WIN32
+        sprintf(dev_name, "\\\\.\\COM%d", comport);
+#else
+        sprintf(dev_name, "/dev/ttyACM%d", comport);
+#endif
+        if (low_latency) { // return as soon as anything arrives, without waiting for more
+            timeouts.ReadIntervalTimeout = MAXDWORD;
+            timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+            timeouts.ReadTotalTimeoutConstant = 100;  // but return now and then to check the keyboard
+        }
+        else {
+            timeouts.ReadIntervalTimeout =  100;  		// msec
+            timeouts.ReadTotalTimeoutConstant = 200;    // msec
+            timeouts.ReadTotalTimeoutMultiplier = 0;  // msec
+        }
+        handle_serial = open_serial_port(dev_name);
+        if ((datfile = fopen(datfilename,"a")) == NULL) // open to append to .dat file
+            fatal_err("raw data file open for append failed");
+    }
+
+    if ((outfile = fopen(OUTFILENAME,"a")) == NULL) fatal_err(OUTFILENAME " open failed");
+    if ((pktfile = fopen(PKTFILENAME,"a")) == NULL) fatal_err(PKTFILENAME " open failed");
+    fprintf(pktfile, "\n");
+    if (write_records) {
+        if ((pktrecfile = fopen(BINFILENAME,"wb")) == NULL) fatal_err(BINFILENAME " open failed");
+        record_events = true;
+    }
+    if (track_radio) {
+        if ((radfile = fopen(RADFILENAME,"a")) == NULL) fatal_err(RADFILENAME " open failed");
+        fprintf(radfile, "\n");
+    }
+
+    // atexit(cleanup);
+    fprintf(stderr, "Starting.\n");
+
+    while(!kbhit()) {
+        if (low_latency) {
+            low_latency_input();
+            continue;
+        }
+        if (fileread) { // read from .dat file
+            if (!fgets(rawline, MAX_LINE, datfile)) end_of_file();
+            ++linecnt;
+            bytes_read = strlen(rawline);
+            output("got %d bytes from the file\n", bytes_read);
+        }
+        else {  // read from serial port
+            // printf("reading serial port com%d...\n", comport);
+            ReadFile(handle_serial, rawline, MAX_LINE-1, &bytes_read, NULL);
+            rawline[bytes_read]='\0';
+            if (bytes_read != 0) {
+                output("got %d bytes from serial port\n", bytes_read);
+                fprintf(stderr, "got %d bytes from the serial port\n", bytes_read);
+                fprintf(datfile, "%s\n", rawline);
+            }
+        }
+
+        if (strcmp(rawline, "SPI Sniffer\n") == 0) {
+            fprintf(stderr, "\"SPI Sniffer\" header line read\n");
+            continue;
+        }
+        decode_input(rawline, bytes_read);
+    }
+    packet_flush();
+    show_latency();
+    show_classes();
+    show_radio();
+    show_histograms();
+    show_reassembly();
+    show_bad_data();
     return 0;
 }
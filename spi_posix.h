@@ -0,0 +1,229 @@
+/*************************************************************************
+
+.          Windows stand-ins for building spi_decode on Linux
+
+spi_decode was written for Windows, where the Sniffer shows up as a virtual
+COM port. This gives it the few Windows calls it uses, done with termios,
+poll, and pthreads, so the same source also builds on Linux, where the
+Sniffer is a /dev/ttyACMn device:
+
+  gcc -O2 -o spi_decode spi_decode_01.c -lm -lpthread
+
+Serial ports are opened non-blocking and raw, and ReadFile follows the
+COMMTIMEOUTS rules: it waits up to ReadTotalTimeoutConstant for the first
+character, and then reads until the line has been quiet for
+ReadIntervalTimeout. An interval of MAXDWORD returns as soon as anything has
+arrived. A port that has gone away, like a pseudo-terminal whose other end
+was closed, makes ReadFile fail, as an unplugged USB port does on Windows.
+
+On a terminal kbhit only sees a key once Enter has been pressed.
+
+--------------------------------------------------------------------------
+*   (C) Copyright 2015, Len Shustek
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of version 3 of the GNU General Public License as
+*   published by the Free Software Foundation at http://www.gnu.org/licenses,
+*   with Additional Permissions under term 7(b) that the original copyright
+*   notice and author attibution must be preserved and under term 7(c) that
+*   modified versions be marked as different from the original.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+**************************************************************************/
+
+#ifndef SPI_POSIX_H
+#define SPI_POSIX_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sys/select.h>
+
+typedef unsigned long DWORD;
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef union {
+    long long QuadPart;
+} LARGE_INTEGER;
+
+#define MAX_PATH 260
+#define MAXDWORD 0xffffffffUL
+#define INFINITE 0xffffffffUL
+#define WAIT_OBJECT_0 0
+#define WINAPI
+#define GENERIC_READ 1
+#define GENERIC_WRITE 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_NORMAL 0
+#define NOPARITY 0
+#define ONESTOPBIT 0
+#define MemoryBarrier() __sync_synchronize()
+
+typedef struct {
+    DWORD DCBlength, BaudRate;
+    BYTE ByteSize, Parity, StopBits;
+} DCB;
+
+typedef struct {
+    DWORD ReadIntervalTimeout, ReadTotalTimeoutMultiplier, ReadTotalTimeoutConstant;
+    DWORD WriteTotalTimeoutMultiplier, WriteTotalTimeoutConstant;
+} COMMTIMEOUTS;
+
+typedef struct {
+    DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(void *);
+
+struct posix_handle {  // a serial port or a thread
+    int fd;                 // -1 for a thread
+    COMMTIMEOUTS timeouts;
+    pthread_t thread;
+    LPTHREAD_START_ROUTINE start;
+    void *param;
+};
+typedef struct posix_handle *HANDLE;
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+
+static inline int posix_fd(HANDLE h) {  // for waiting on ports with poll or epoll
+    return h->fd;
+}
+
+//****************  serial ports  ****************
+
+static inline HANDLE CreateFile(const char *name, DWORD access, DWORD share, void *security,
+                                DWORD creation, DWORD attributes, void *template_file) {
+    HANDLE h;
+    int fd = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) return INVALID_HANDLE_VALUE;
+    if ((h = calloc(1, sizeof(*h))) == NULL) {
+        close(fd);
+        return INVALID_HANDLE_VALUE;
+    }
+    h->fd = fd;
+    return h;
+}
+
+static inline BOOL SetCommState(HANDLE h, DCB *dcb) {
+    struct termios tio;
+    if (tcgetattr(h->fd, &tio) != 0) return 0;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (dcb->BaudRate == 115200) cfsetspeed(&tio, B115200);  // USB serial ignores it anyway
+    return tcsetattr(h->fd, TCSANOW, &tio) == 0;
+}
+
+static inline BOOL SetCommTimeouts(HANDLE h, COMMTIMEOUTS *timeouts) {
+    h->timeouts = *timeouts;
+    return 1;
+}
+
+static inline int posix_wait(int fd, DWORD msec) {  // >0 if there is input or the port has gone
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready;
+    while ((ready = poll(&pfd, 1, msec == MAXDWORD ? -1 : (int)msec)) < 0 && errno == EINTR) ;
+    return ready;
+}
+
+static inline BOOL ReadFile(HANDLE h, void *buf, DWORD size, DWORD *got, void *overlapped) {
+    DWORD wait = h->timeouts.ReadTotalTimeoutConstant;
+    *got = 0;
+    while (*got < size) {
+        ssize_t n;
+        if (wait > 0 && posix_wait(h->fd, wait) <= 0) break;  // quiet for long enough
+        n = read(h->fd, (char *)buf + *got, size - *got);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (wait == 0) break;
+            continue;
+        }
+        if (n <= 0) return *got > 0;  // the port has gone away
+        *got += n;
+        if (h->timeouts.ReadIntervalTimeout == MAXDWORD) break;
+        wait = h->timeouts.ReadIntervalTimeout;
+    }
+    return 1;
+}
+
+//****************  threads  ****************
+
+static void *posix_thread_start(void *param) {
+    HANDLE h = param;
+    h->start(h->param);
+    return NULL;
+}
+
+static inline HANDLE CreateThread(void *security, size_t stack, LPTHREAD_START_ROUTINE start,
+                                  void *param, DWORD flags, DWORD *id) {
+    HANDLE h = calloc(1, sizeof(*h));
+    if (h == NULL) return NULL;
+    h->fd = -1;
+    h->start = start;
+    h->param = param;
+    if (pthread_create(&h->thread, NULL, posix_thread_start, h) != 0) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+static inline DWORD WaitForSingleObject(HANDLE h, DWORD msec) {  // only for threads, only INFINITE
+    pthread_join(h->thread, NULL);
+    h->start = NULL;
+    return WAIT_OBJECT_0;
+}
+
+static inline BOOL CloseHandle(HANDLE h) {
+    int result = 0;
+    if (h->fd >= 0) result = close(h->fd);
+    else if (h->start) pthread_detach(h->thread);
+    free(h);
+    return result == 0;
+}
+
+//****************  the rest  ****************
+
+static inline void Sleep(DWORD msec) {
+    struct timespec ts = { msec / 1000, (msec % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) ;
+}
+
+static inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency) {
+    frequency->QuadPart = 1000000000LL;
+    return 1;
+}
+
+static inline BOOL QueryPerformanceCounter(LARGE_INTEGER *count) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    count->QuadPart = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return 1;
+}
+
+static inline void GetSystemInfo(SYSTEM_INFO *info) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    info->dwNumberOfProcessors = n > 0 ? n : 1;
+}
+
+static inline int kbhit(void) {
+    fd_set fds;
+    struct timeval tv = { 0, 0 };
+    if (!isatty(STDIN_FILENO)) return 0;
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    return select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+#endif
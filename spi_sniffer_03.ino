@@ -40,6 +40,8 @@ below has to be decently optimized and have no extraneous processing.
 The output is sent over the USB serial port whenever there has
 been a long period of inactivity, or when the buffer is full.
 If there is lots of constant SPI bus activity, data loss is inevitable.
+If LOW_LATENCY is on, it is also sent as soon as a TX or RX FIFO burst
+transaction ends, so packets can be decoded while they are still fresh.
 
 The output data stream is in ASCII and has the following elements:
 
@@ -50,6 +52,24 @@ tnnnn.      timestamp: it's now nnnn microseconds after the last report
 wnnnn.      start of new buffer with nnnn "events" (SS change, or data)
 \n          newline every so often, for prettiness
 
+If CYCLE_TIMES is on, every event is timed with the Cortex-M4 cycle counter
+instead, so we can see the time between bytes and how long slave select was
+high, to within a cycle (10.4 nsec at 96 Mhz). Reading it takes two cycles,
+where micros() took most of a microsecond. Each event gets the number of
+cycles since the one before, in 16 bits, in the memory the timestamps used to
+take; a longer time goes in an extra event of its own. The stream then has
+
+Knnnn.      at the start of each buffer: the cycle counter runs at nnnn Hz
+knnnn.      before each event: it's now nnnn cycles after the last event,
+            or, by itself, that many cycles have passed
+
+and no "t" timestamps. spi_sniffer_model -c checks that the capture loop
+can still keep up with the fastest bytes this way.
+
+If COMPRESS is on, runs of identical slave data and repeats of recent
+transactions are sent in the shorter forms described in spi_compress.h,
+which spi_decode expands transparently.
+
 The output is decoded and interpreted on the PC by the spi_decode program.
 
 --------------------------------------------------------------------------
@@ -80,14 +100,29 @@ Change log
                                 So we switch to collecting all the SPI data with
                                 external hardware.
  6 Aug 2015,  L. Shsutek, V4.1  Add optional code to create an oscilloscope trigger.
+18 Oct 2026,              V4.2  Add optional compression of the output, to shorten
+                                the time we are deaf while sending.
+18 Oct 2026,              V4.3  Add optional low-latency mode that sends each FIFO
+                                transaction immediately.
+18 Oct 2026,              V4.4  Add optional timing of every event with the cycle
+                                counter.
 
 **************************************************************************/
 
 #define CONSOLE 0  // debugging console?
 #define SCOPE_CODE 0 // special code for scope trigger?
+#define COMPRESS 1   // compress the output? (see spi_compress.h)
+#define LOW_LATENCY 0 // send FIFO transactions right away?
+#define CYCLE_TIMES 0 // time every event with the cycle counter?
+
+#if CYCLE_TIMES
+#undef COMPRESS
+#define COMPRESS 0   // the times of repeated transactions are never the same
+#endif
 
 #include <arduino.h>
 #include <SPI.h>
+#include "spi_compress.h"
 
 #define DATA_IN GPIOD_PDIR  // MOSI and MISO data lines are wired to shift registers on port D
 
@@ -105,11 +140,25 @@ Change log
 
 byte data_master [MAX_DATA + 2];
 byte data_slave [MAX_DATA + 2];
-byte data_flag [MAX_DATA + 2];  // 00=data, 80=slave select, 81=slave unselect
+byte data_flag [MAX_DATA + 2];  // 00=data, 80=slave select, 81=slave unselect, 83=only time
+#if CYCLE_TIMES
+#define CYCLES_ESCAPE 0xffff  // too long for data_cycles
+uint16_t data_cycles [MAX_DATA + 2]; // cycles since the previous event, for every event
+uint32_t cycles_before;  // the cycle counter at the last event
+#else
 unsigned long data_timestamp [MAX_DATA + 2]; // timestamp every slave select change
+#endif
 
 char string [20];
 
+#if COMPRESS
+struct sc_encoder encoder;  // includes the cache of recent transactions
+
+void serial_write(const char *str, int len) {
+  Serial.write((const uint8_t *)str, len);
+}
+#endif
+
 void setup() {
   Serial.begin(115200);
 #if CONSOLE
@@ -121,6 +170,15 @@ void setup() {
   }
 #endif
 
+#if COMPRESS
+  encoder.write = serial_write;
+#endif
+
+#if CYCLE_TIMES
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;  // start the cycle counter
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+#endif
+
   pinMode(INPUT_SELECT, OUTPUT);
   pinMode(DATA_READY, INPUT);
   pinMode(SSNOT, INPUT);
@@ -142,11 +200,43 @@ void setup() {
 
 unsigned long delta; // TEMP
 
+#if CYCLE_TIMES
+// A time too long for 16 bits goes in an event of its own: the top 16 bits in
+// the master and slave data, and the rest in data_cycles. The slave data of a
+// byte is stored one event late, so we move it along past the extra event.
+
+unsigned int record_gap(unsigned int n, uint32_t cycles) {
+  data_slave[n + 1] = data_slave[n];
+  data_flag[n] = 0x83;
+  data_master[n] = (byte) (cycles >> 24);
+  data_slave[n] = (byte) (cycles >> 16);
+  data_cycles[n] = (uint16_t) cycles;
+  return n + 1;
+}
+
+// Time the event that is about to be recorded at n, and return where it goes.
+static inline unsigned int record_cycles(unsigned int n) {
+  uint32_t now = ARM_DWT_CYCCNT;
+  uint32_t cycles = now - cycles_before;
+  cycles_before = now;
+  if (cycles >= CYCLES_ESCAPE) {
+    n = record_gap(n, cycles);
+    cycles = 0;
+  }
+  data_cycles[n] = (uint16_t) cycles;
+  return n;
+}
+#endif
+
 void loop() {
   unsigned long timer;
   unsigned long time_now, time_before;
   byte last_ss, new_ss;
   unsigned int numbytes, numdbytes;
+#if LOW_LATENCY
+  unsigned int txn_start = MAX_DATA; // where the first data byte of the current transaction goes
+  byte send_now = 0;
+#endif
 
 #if 0 // scope timing loop: takes about 0.814 usec per loop at 96 Mhz, so micros() is pretty fast!
   { byte toggle = 0;
@@ -168,6 +258,9 @@ void loop() {
   last_ss = 1; // default slave select is high
   numbytes = 0; numdbytes = 0;
   time_before = micros();
+#if CYCLE_TIMES
+  cycles_before = ARM_DWT_CYCCNT;
+#endif
 
   // We buffer up bytes and slave select changes while they happen, fast, without
   // sending anything to the host. When there's a pause or our buffer overflows, send it all.
@@ -176,6 +269,9 @@ void loop() {
 
     if (digitalReadFast(DATA_READY)) {  // transfer complete: received a byte
       if (numbytes < MAX_DATA) {
+#if CYCLE_TIMES
+        numbytes = record_cycles(numbytes);
+#endif
         data_master[numbytes] = (byte) DATA_IN; // read master data from shift register
 #if SCOPE_CODE
         if (data_master[numbytes] == 0x7F  // STX command (0x35), PATABLE (0x3E), SRES (0x30), burst regs (0x40), write FIFO (0x7F)
@@ -194,25 +290,58 @@ void loop() {
     new_ss = digitalReadFast(SSNOT); // read slave select (SS) level
     if (new_ss != last_ss) {    // if slave select changed, record it now
       if (numbytes < MAX_DATA) {
+#if CYCLE_TIMES
+        numbytes = record_cycles(numbytes);
+#endif
         if (new_ss == 0) {  // if this is "select" (low)
+#if !CYCLE_TIMES
           time_now = micros(); // then also record a timestamp
           data_timestamp[numbytes] = time_now - time_before;
           time_before = time_now;
+#endif
+#if LOW_LATENCY
+          txn_start = numbytes + 1;
+#endif
         }
+#if LOW_LATENCY
+        else if (txn_start < numbytes && data_flag[txn_start] == 0
+                 && (data_master[txn_start] & 0x7f) == 0x7f) // end of burst TX (7F) or RX (FF) FIFO access
+          send_now = 1;
+#endif
         data_flag[numbytes++] = new_ss | 0x80; // 0x80 for slave select, 0x81 for slave unselect
       }
       last_ss = new_ss;
     }
 
     if (++timer > TIMEOUT  // nothing received after timeout
+#if LOW_LATENCY
+        || send_now  // or a packet just went by
+#endif
         || numbytes >= MAX_DATA) { // or our buffer is full
       if (numbytes > 0) { // write the buffer
+#if COMPRESS
+        sc_encode_buffer(&encoder, data_flag, data_master, data_slave, data_timestamp, numbytes);
+#else
         Serial.print('w'); Serial.print(numbytes); Serial.print('.');  // mark buffer write
+#if CYCLE_TIMES
+        Serial.print('K'); Serial.print(F_CPU); Serial.print('.');  // the rate of the cycle counter
+#endif
         for (unsigned int i = 0; i < numbytes; ++i) {
 
+#if CYCLE_TIMES
+          Serial.print('k');
+          if (data_flag[i] == 0x83) { // only a long time
+            Serial.print(((uint32_t) data_master[i] << 24) | ((uint32_t) data_slave[i] << 16) | data_cycles[i]);
+            Serial.print('.');
+            continue;
+          }
+          Serial.print(data_cycles[i]); Serial.print('.');
+          if (data_flag[i] == 0x80) Serial.print('[');
+#else
           if (data_flag[i] == 0x80) { // slave select, which also has a timestamp
             Serial.print('t'); Serial.print(data_timestamp[i]); Serial.print(".[");
           }
+#endif
           else if (data_flag[i] == 0x81) { // slave unselect
             Serial.print(']');
             if (numdbytes > 16) { // extra LF every so often after deselect, for prettiness
@@ -231,8 +360,20 @@ void loop() {
             ++numdbytes;
           }
         } // for all bytes
+#endif
+#if LOW_LATENCY
+        Serial.send_now();  // don't wait for the USB packet to fill up
+        send_now = 0;
+        txn_start = MAX_DATA;  // the transaction we are in, if any, started in the buffer we sent
+#endif
         numbytes = 0;
       }
+#if CYCLE_TIMES
+      if (ARM_DWT_CYCCNT - cycles_before >= 0x80000000UL) { // don't let the counter go all the way around
+        numbytes = record_gap(numbytes, 0x80000000UL);
+        cycles_before += 0x80000000UL;
+      }
+#endif
       timer = 0;
     }
   }
@@ -0,0 +1,737 @@
+/*********************************************************************************
+*
+*		SPI Sniffer firmware model
+*
+*********************************************************************************
+
+This is a command-line program that runs the Sniffer firmware's output code
+on the PC, so we can see how it would behave on traffic we have already
+recorded, without having to reprogram the Teensy and recapture.
+
+It reads recorded .dat files, rebuilds the buffers of events that the firmware
+had collected, and sends each buffer through the compressing encoder in
+spi_compress.h. For each file it reports
+  - the number of characters the uncompressed firmware sent
+  - the number of characters the compressing firmware would send, and the ratio
+  - how many runs and repeated transactions were used
+  - the encoder cost per event on this PC
+  - an estimate of the encoder cost per event in Teensy cycles, from counting
+    what the encoder does and the cycles that takes on a Cortex-M4
+It also expands the compressed stream again and checks that it is identical to
+the uncompressed stream, which is what the decoder relies on. It does that a
+second time the way the decoder replays its own recording, in pieces of random
+size with a newline after each, which can fall inside a run or a repeat.
+
+With -r it instead plays the files back in real time, each through its own
+pseudo-terminal, as stand-ins for several Sniffers, so that spi_decode -w can
+be tried on them without the hardware. This only works on Linux.
+
+With -c it instead models the firmware's capture loop on the files, to check
+that it still reads every byte in time when it also reads the cycle counter
+for every event (CYCLE_TIMES), and writes the stream that firmware would send.
+
+Usage: spi_sniffer_model file.dat [file.dat...]
+       spi_sniffer_model -r[speed] file.dat [file.dat...]
+       spi_sniffer_model -c file.dat [file.dat...]
+
+*----------------------------------------------------------------------------------
+*   (C) Copyright 2015 Len Shustek
+*
+*   This program is free software: you can redistribute it and/or modify
+*   it under the terms of version 3 of the GNU General Public License as
+*   published by the Free Software Foundation at http://www.gnu.org/licenses,
+*   with Additional Permissions under term 7(b) that the original copyright
+*   notice and author attibution must be preserved and under term 7(c) that
+*   modified versions be marked as different from the original.
+*
+*   This program is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+***********************************************************************************/
+
+#ifndef _WIN32
+#define _GNU_SOURCE  // for the pseudo-terminals
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#endif
+#define SC_COUNT_WORK
+#include "spi_compress.h"
+
+#define MAX_DATA 7000  // as in the firmware
+#define MAX_BUFFERS 20000
+#define MIN_TIMING_SEC 0.2  // repeat the encoding for at least this long when timing it
+#define REPLAY_PIECE_MAX 64 // the longest piece when replaying as the decoder does
+
+// Cortex-M4 cycles for the encoder's work, estimated from the instruction timings
+#define ENC_EVENT_CYCLES 10   // look at the flag and go around the loop
+#define ENC_CHAR_CYCLES 7     // put a character in the output buffer, and convert it
+#define ENC_HASH_CYCLES 7     // hash a data byte
+#define ENC_SLOT_CYCLES 6     // look at a cache slot
+#define ENC_COMPARE_CYCLES 3  // compare a byte with one in the cache
+#define ENC_COPY_CYCLES 1     // copy a byte into the cache
+
+struct buffer {  // what the firmware had recorded when it sent a buffer
+    unsigned int numevents;
+    unsigned char flag[MAX_DATA + 2];
+    unsigned char master[MAX_DATA + 2];
+    unsigned char slave[MAX_DATA + 2];
+    unsigned long timestamp[MAX_DATA + 2];
+};
+
+struct buffer *buffers[MAX_BUFFERS];
+int numbuffers;
+size_t total_events;  // in all the buffers
+
+struct damage {  // what we couldn't read in the recording, kept to be written again with -c
+    size_t before;      // the event it came before
+    size_t start, len;  // in damage_text
+} *damage;
+size_t numdamage, damage_size;
+char *damage_text;  // cut off data pairs, '!' for data the Sniffer lost, and anything else
+size_t damage_text_len, damage_text_size;
+
+char *plain, *compressed, *expanded;  // output streams
+size_t plain_len, compressed_len, max_len;
+bool collect_output;
+
+void fatal_err(const char *err) {
+    fprintf(stderr, "%s\n", err);
+    exit(98);
+}
+
+void append(char **dst, size_t *len, const char *str, int strlen) {
+    if (*len + strlen > max_len) fatal_err("output too big");
+    memcpy(*dst + *len, str, strlen);
+    *len += strlen;
+}
+
+void write_compressed(const char *str, int len) {
+    if (collect_output) append(&compressed, &compressed_len, str, len);
+    else compressed_len += len;
+}
+
+//**************  read a recorded file into buffers of events  ***************
+
+void new_buffer(void) {
+    if (numbuffers >= MAX_BUFFERS) fatal_err("too many buffers");
+    if (buffers[numbuffers] == NULL
+            && (buffers[numbuffers] = malloc(sizeof(struct buffer))) == NULL)
+        fatal_err("out of memory");
+    buffers[numbuffers++]->numevents = 0;
+}
+
+void add_event(unsigned char flag, unsigned char master, unsigned char slave, unsigned long timestamp) {
+    struct buffer *buf;
+    if (numbuffers == 0 || buffers[numbuffers - 1]->numevents >= MAX_DATA) new_buffer();
+    buf = buffers[numbuffers - 1];
+    buf->flag[buf->numevents] = flag;
+    buf->master[buf->numevents] = master;
+    buf->slave[buf->numevents] = slave;
+    buf->timestamp[buf->numevents] = timestamp;
+    ++buf->numevents;
+    ++total_events;
+}
+
+void add_damage(const char *text, size_t len) {  // added to what is already there before the same event
+    if (damage_text_len + len > damage_text_size) {
+        while (damage_text_len + len > damage_text_size) damage_text_size = damage_text_size ? 2 * damage_text_size : 4096;
+        if ((damage_text = realloc(damage_text, damage_text_size)) == NULL) fatal_err("out of memory");
+    }
+    memcpy(damage_text + damage_text_len, text, len);
+    damage_text_len += len;
+    if (numdamage > 0 && damage[numdamage - 1].before == total_events) {
+        damage[numdamage - 1].len += len;
+        return;
+    }
+    if (numdamage >= damage_size) {
+        damage_size = damage_size ? 2 * damage_size : 1024;
+        if ((damage = realloc(damage, damage_size * sizeof(*damage))) == NULL) fatal_err("out of memory");
+    }
+    damage[numdamage].before = total_events;
+    damage[numdamage].start = damage_text_len - len;
+    damage[numdamage++].len = len;
+}
+
+void read_file(FILE *datfile) {
+    int ch;
+    unsigned long timestamp = 0;
+    numbuffers = 0;
+    total_events = 0;
+    numdamage = damage_text_len = 0;
+    while ((ch = getc(datfile)) != EOF) {
+        if (ch == 'w' || ch == 't') {
+            unsigned long val;
+            char c = (char)ch;
+            if (fscanf(datfile, " %lu", &val) != 1) {
+                add_damage(&c, 1);
+                continue;
+            }
+            if (ch == 'w') new_buffer();
+            else timestamp = val;
+            if ((ch = getc(datfile)) != '.' && ch != EOF) ungetc(ch, datfile);
+        }
+        else if (ch == '[') {
+            add_event(SC_SS_SELECT, 0, 0, timestamp);
+            timestamp = 0;
+        }
+        else if (ch == ']') add_event(SC_SS_UNSELECT, 0, 0, 0);
+        else if (sc_hexval((char)ch) >= 0) {
+            char text[4] = {(char)ch};
+            int val = sc_hexval((char)ch), nibbles = 1;
+            while (nibbles < 4 && (ch = getc(datfile)) != EOF && sc_hexval((char)ch) >= 0) {
+                val = (val << 4) | sc_hexval((char)ch);
+                text[nibbles++] = (char)ch;
+            }
+            if (nibbles == 4) add_event(0, (unsigned char)(val >> 8), (unsigned char)val, 0);
+            else {
+                add_damage(text, nibbles);
+                if (ch != EOF) ungetc(ch, datfile);
+            }
+        }
+        else if (ch != '\r' && ch != '\n') {  // not something we understand, like the '!' of lost data
+            char c = (char)ch;
+            add_damage(&c, 1);
+        }
+    }
+}
+
+//**************  what the uncompressed firmware sends  ***************
+
+void plain_buffer(struct buffer *buf, unsigned int *numdbytes) {
+    char string[20];
+    int len;
+    len = sprintf(string, "w%u.", buf->numevents);
+    append(&plain, &plain_len, string, len);
+    for (unsigned int i = 0; i < buf->numevents; ++i) {
+        if (buf->flag[i] == SC_SS_SELECT) {
+            len = sprintf(string, "t%lu.[", buf->timestamp[i]);
+            append(&plain, &plain_len, string, len);
+        }
+        else if (buf->flag[i] == SC_SS_UNSELECT) {
+            append(&plain, &plain_len, "]", 1);
+            if (*numdbytes > 16) {
+                append(&plain, &plain_len, "\r\n", 2);
+                *numdbytes = 0;
+            }
+        }
+        else {
+            len = sprintf(string, "%02X%02X", buf->master[i], buf->slave[i]);
+            append(&plain, &plain_len, string, len);
+            ++*numdbytes;
+        }
+    }
+}
+
+//**************  model one file  ***************
+
+double encoder_cycles(const struct sc_work *work, unsigned long long events) {  // estimated, on the Teensy
+    return (double)events * ENC_EVENT_CYCLES + (double)work->chars * ENC_CHAR_CYCLES
+           + (double)work->hashed * ENC_HASH_CYCLES + (double)work->slots * ENC_SLOT_CYCLES
+           + (double)work->compared * ENC_COMPARE_CYCLES + (double)work->copied * ENC_COPY_CYCLES;
+}
+
+bool replay_matches(void) {  // expand the compressed stream as the decoder replays its .dat file
+    static struct sc_expander expander;
+    unsigned int seed = 1;
+    size_t pos = 0, expanded_len = 0, plain_pos = 0;
+    memset(&expander, 0, sizeof(expander));
+    while (pos < compressed_len) {
+        int piece;
+        seed = seed * 1103515245 + 12345;
+        piece = 1 + (int)((seed >> 16) % REPLAY_PIECE_MAX);
+        if (piece > (int)(compressed_len - pos)) piece = (int)(compressed_len - pos);
+        expanded_len += sc_expand(&expander, &compressed[pos], piece, &expanded[expanded_len]);
+        expanded_len += sc_expand(&expander, "\n", 1, &expanded[expanded_len]);
+        pos += piece;
+    }
+    for (size_t i = 0; i < expanded_len; ++i)  // the same, except for line breaks
+        if (expanded[i] != '\r' && expanded[i] != '\n') {
+            while (plain_pos < plain_len && (plain[plain_pos] == '\r' || plain[plain_pos] == '\n')) ++plain_pos;
+            if (plain_pos >= plain_len || plain[plain_pos++] != expanded[i]) return false;
+        }
+    while (plain_pos < plain_len && (plain[plain_pos] == '\r' || plain[plain_pos] == '\n')) ++plain_pos;
+    return plain_pos == plain_len;
+}
+
+struct totals {
+    unsigned long long events, plain, compressed;
+    double seconds, cycles;
+} total;
+
+void model_file(const char *filename) {
+    static struct sc_encoder encoder;
+    static struct sc_expander expander;
+    unsigned long long events = 0;
+    unsigned int numdbytes = 0;
+    size_t expanded_len;
+    int reps;
+    clock_t start;
+    double seconds, cycles;
+    FILE *datfile;
+
+    if ((datfile = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "can't open %s\n", filename);
+        return;
+    }
+    read_file(datfile);
+    fclose(datfile);
+    for (int b = 0; b < numbuffers; ++b) events += buffers[b]->numevents;
+    if (events == 0) {
+        printf("%-32s no events\n", filename);
+        return;
+    }
+    max_len = (size_t)events * 16 + 1000;
+    if ((plain = realloc(plain, max_len)) == NULL
+            || (compressed = realloc(compressed, max_len)) == NULL
+            || (expanded = realloc(expanded, max_len * SC_EXPAND_MAX)) == NULL)
+        fatal_err("out of memory");
+
+    // both streams, for the size comparison and the round trip check
+    plain_len = compressed_len = 0;
+    memset(&encoder, 0, sizeof(encoder));
+    encoder.write = write_compressed;
+    collect_output = true;
+    for (int b = 0; b < numbuffers; ++b) {
+        plain_buffer(buffers[b], &numdbytes);
+        sc_encode_buffer(&encoder, buffers[b]->flag, buffers[b]->master, buffers[b]->slave,
+                         buffers[b]->timestamp, buffers[b]->numevents);
+    }
+    memset(&expander, 0, sizeof(expander));
+    expanded_len = sc_expand(&expander, compressed, (int)compressed_len, expanded);
+    if (expanded_len != plain_len || memcmp(expanded, plain, plain_len) != 0)
+        printf("%-32s **** expanded output is different from the uncompressed output!\n", filename);
+    if (!replay_matches())
+        printf("%-32s **** expanded output from pieces is different from the uncompressed output!\n", filename);
+
+    // the encoder cost, with the output just counted, as if sent
+    collect_output = false;
+    compressed_len = 0;
+    reps = 0;
+    start = clock();
+    do {
+        memset(&encoder, 0, sizeof(encoder));
+        encoder.write = write_compressed;
+        for (int b = 0; b < numbuffers; ++b)
+            sc_encode_buffer(&encoder, buffers[b]->flag, buffers[b]->master, buffers[b]->slave,
+                             buffers[b]->timestamp, buffers[b]->numevents);
+        ++reps;
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+    while (seconds < MIN_TIMING_SEC);
+
+    cycles = encoder_cycles(&encoder.cache.work, events);
+    printf("%-32s %8llu %9lu %9lu %5.2f %7lu %7lu %7.1f %7.1f\n",
+           filename, events, (unsigned long)plain_len, (unsigned long)(compressed_len / reps),
+           (double)plain_len / (compressed_len / reps), expander.runs, expander.repeats,
+           seconds * 1e9 / ((double)events * reps), cycles / events);
+    total.events += events;
+    total.plain += plain_len;
+    total.compressed += compressed_len / reps;
+    total.seconds += seconds / reps;
+    total.cycles += cycles;
+}
+
+//**************  model the capture loop's cycle budget  ***************
+
+/* With -c we check that the firmware's capture loop still keeps up with the
+fastest SPI traffic when it reads the cycle counter for every event. The
+recordings don't say when each byte came, so we assume the worst: the bytes of
+a transaction 2.3 usec apart, the fastest the devices send them. Each byte has
+to be read from the shift registers within the 1 usec the bus is idle after
+it, before the next byte starts shifting in, and a change of slave select has
+to be seen before the byte after it is ready, or the two would be recorded in
+the wrong order.
+
+The loop is modelled as the pieces it does on each path, with the number of
+cycles each one takes, estimated from the Cortex-M4 instruction timings: 3 for
+a load from a peripheral register, 2 for other loads and stores, 3 for a taken
+branch. micros() is from the 0.814 usec the scope showed for the old loop. We
+step the model through the events of each file, once as it is and once with
+CYCLE_TIMES, and report how late the bytes were read and how much of the 1 usec
+was left. Because the bytes are always placed 2.3 usec apart, a file gives the
+model only the order of its events and the gaps between its transactions, and
+the latency and slack come out the same for every file that doesn't make the
+loop fall behind. They are the worst case for that byte timing, not anything
+measured from the recording.
+
+The stream the CYCLE_TIMES firmware would have sent, with the cycle times from
+the model, goes to file.cycles.dat for trying spi_decode on. Whatever in the
+recording wasn't understood, like data pairs that were cut off and the '!' of
+data the Sniffer lost, is written again in the same place, so the new stream
+has the same damage as the old one. */
+
+#define CPU_HZ 96000000
+#define CYCLES_PER_USEC (CPU_HZ / 1000000)
+#define BYTE_CYCLES 221        // 2.3 usec between bytes
+#define SHIFT_CYCLES 128       // 8 bits at 6 Mhz
+#define IDLE_CYCLES 96         // 1 usec to read a byte before the next one shifts in
+#define SELECT_SETUP_CYCLES 16 // from slave select going low to the first clock
+#define UNSELECT_CYCLES 32     // from the last byte to slave select going high
+#define EMPTY_CYCLES 221       // slave select low with no bytes: we guess a byte's time
+#define MIN_HIGH_CYCLES 48     // the shortest time slave select is high
+#define CYCLES_ESCAPE 0xffff   // as in the firmware
+#define CYCLES_WRAP 0x80000000UL
+
+enum loop_piece {
+    LP_READY,     // read DATA_READY, test, branch
+    LP_DATA,      // check room, read master, switch to slave, flag, wait, read slave, switch back
+    LP_SS,        // read SSNOT, compare, branch
+    LP_SELECT,    // check room, flag, remember the level
+    LP_MICROS,    // micros() and storing the timestamp
+    LP_UNSELECT,  // check room, flag, remember the level
+    LP_CYCLES,    // read the cycle counter, subtract, test for the escape, store
+    LP_ESCAPE,    // the extra event for a long time
+    LP_TIMER,     // count, test the timeout and for a full buffer, loop
+    LP_NUM
+};
+const struct {
+    const char *name;
+    int cycles;
+} loop_pieces[LP_NUM] = {
+    {"DATA_READY test", 6}, {"read a byte", 24}, {"SSNOT test", 6}, {"select", 7},
+    {"micros()", 66}, {"unselect", 7}, {"cycle counter", 11}, {"long time", 14}, {"timer", 8}
+};
+#define SLAVE_READ_CYCLES 19   // into reading a byte: when the slave data has been read
+#define COUNTER_READ_CYCLES 2  // into the cycle counter: when it has been read
+
+struct bus_event {  // what happened on the bus, and when, in cycles
+    unsigned char flag, master, slave;
+    unsigned long long when;  // when it happened
+    unsigned long long seen;  // when the firmware read the cycle counter for it
+};
+struct bus_event *bus;
+size_t bus_len, bus_size;
+
+struct loop_results {
+    unsigned long long bytes, late, misordered, missed;
+    long long worst_latency;  // from a byte being ready to its slave data being read
+    int worst_loop;           // the longest time around the loop with a byte in it
+};
+
+void make_bus_events(void) {  // from the recorded buffers, with the bytes as fast as they come
+    unsigned long long last_select = 0, last = 0;
+    bus_len = 0;
+    for (int b = 0; b < numbuffers; ++b) {
+        struct buffer *buf = buffers[b];
+        for (unsigned int i = 0; i < buf->numevents; ++i) {
+            struct bus_event *e;
+            if (bus_len >= bus_size) {
+                bus_size = bus_size ? 2 * bus_size : 65536;
+                if ((bus = realloc(bus, bus_size * sizeof(*bus))) == NULL) fatal_err("out of memory");
+            }
+            e = &bus[bus_len];
+            if (buf->flag[i] == SC_SS_SELECT) {
+                e->when = last_select + (unsigned long long)buf->timestamp[i] * CYCLES_PER_USEC;
+                if (e->when < last + MIN_HIGH_CYCLES) e->when = last + MIN_HIGH_CYCLES;
+                last_select = e->when;
+            }
+            else if (buf->flag[i] == SC_SS_UNSELECT)
+                e->when = last + (bus_len > 0 && bus[bus_len - 1].flag == SC_SS_SELECT ? EMPTY_CYCLES : UNSELECT_CYCLES);
+            else if (bus_len > 0 && bus[bus_len - 1].flag == SC_SS_SELECT)
+                e->when = last + SELECT_SETUP_CYCLES + SHIFT_CYCLES;
+            else e->when = last + BYTE_CYCLES;
+            e->flag = buf->flag[i];
+            e->master = buf->master[i];
+            e->slave = buf->slave[i];
+            e->seen = 0;
+            last = e->when;
+            ++bus_len;
+        }
+    }
+}
+
+int loop_counter(unsigned long long now, unsigned long long *cycles_before, struct bus_event *e) {
+    int cost = loop_pieces[LP_CYCLES].cycles;  // what the firmware's record_cycles takes
+    e->seen = now + COUNTER_READ_CYCLES;
+    if (e->seen - *cycles_before >= CYCLES_ESCAPE) cost += loop_pieces[LP_ESCAPE].cycles;
+    *cycles_before = e->seen;
+    return cost;
+}
+
+void run_loop_model(bool cycle_times, struct loop_results *r) {
+    unsigned long long now = 0, cycles_before = 0;
+    const int idle_loop = loop_pieces[LP_READY].cycles + loop_pieces[LP_SS].cycles + loop_pieces[LP_TIMER].cycles;
+    size_t next = 0;
+    memset(r, 0, sizeof(*r));
+    while (next < bus_len) {
+        unsigned long long loop_start = now;
+        bool got_byte = false;
+        now += loop_pieces[LP_READY].cycles;  // DATA_READY has been sampled
+        if (bus[next].flag == 0 && bus[next].when <= now) {
+            long long latency;
+            if (cycle_times) now += loop_counter(now, &cycles_before, &bus[next]);
+            latency = (long long)(now + SLAVE_READ_CYCLES - bus[next].when);
+            if (latency > r->worst_latency) r->worst_latency = latency;
+            if (latency > IDLE_CYCLES) ++r->late;  // the next byte has started to shift in
+            now += loop_pieces[LP_DATA].cycles;
+            ++r->bytes;
+            ++next;
+            got_byte = true;
+        }
+        else if (bus[next].flag != 0 && bus[next].when <= now  // a byte after the change is already there
+                 && next + 1 < bus_len && bus[next + 1].flag == 0 && bus[next + 1].when <= now)
+            ++r->misordered;
+        now += loop_pieces[LP_SS].cycles;  // SSNOT has been sampled
+        if (next < bus_len && bus[next].flag != 0 && bus[next].when <= now) {
+            bool select = bus[next].flag == SC_SS_SELECT;
+            if (next + 1 < bus_len && bus[next + 1].flag != 0 && bus[next + 1].when <= now) {
+                r->missed += 2;  // it went and came back between looks
+                next += 2;
+                continue;
+            }
+            if (cycle_times) now += loop_counter(now, &cycles_before, &bus[next]);
+            else if (select) now += loop_pieces[LP_MICROS].cycles;
+            now += loop_pieces[select ? LP_SELECT : LP_UNSELECT].cycles;
+            ++next;
+        }
+        now += loop_pieces[LP_TIMER].cycles;
+        if (got_byte && (int)(now - loop_start) > r->worst_loop) r->worst_loop = (int)(now - loop_start);
+        if (next < bus_len && bus[next].when > now + BYTE_CYCLES)  // go around idle until just before it
+            now += (bus[next].when - now) / idle_loop * idle_loop - idle_loop;
+    }
+}
+
+void write_cycles_file(const char *filename) {  // what the CYCLE_TIMES firmware would send
+    char outname[1024];
+    const char *ext = strrchr(filename, '.');
+    unsigned long long cycles_before = 0;
+    unsigned int numdbytes = 0;
+    size_t next = 0, d = 0;
+    FILE *out;
+    snprintf(outname, sizeof(outname), "%.*s.cycles.dat",
+             ext ? (int)(ext - filename) : (int)strlen(filename), filename);
+    if ((out = fopen(outname, "w")) == NULL) {
+        fprintf(stderr, "can't create %s\n", outname);
+        return;
+    }
+    for (int b = 0; b < numbuffers; ++b) {
+        unsigned int numevents = buffers[b]->numevents;
+        unsigned long long before = cycles_before;
+        for (size_t i = next; i < next + buffers[b]->numevents; ++i) {  // count the extra events
+            unsigned long long cycles = bus[i].seen - before;
+            numevents += (unsigned int)(cycles / CYCLES_WRAP);
+            if (cycles % CYCLES_WRAP >= CYCLES_ESCAPE) ++numevents;
+            before = bus[i].seen;
+        }
+        fprintf(out, "w%u.K%d.", numevents, CPU_HZ);
+        for (unsigned int n = 0; n < buffers[b]->numevents; ++n, ++next) {
+            struct bus_event *e = &bus[next];
+            unsigned long long cycles = e->seen - cycles_before;
+            for (; d < numdamage && damage[d].before <= next; ++d) fwrite(damage_text + damage[d].start, 1, damage[d].len, out);
+            for (; cycles >= CYCLES_WRAP; cycles -= CYCLES_WRAP) fprintf(out, "k%lu.", CYCLES_WRAP);
+            if (cycles >= CYCLES_ESCAPE) {
+                fprintf(out, "k%llu.", cycles);
+                cycles = 0;
+            }
+            fprintf(out, "k%llu.", cycles);
+            cycles_before = e->seen;
+            if (e->flag == SC_SS_SELECT) fputc('[', out);
+            else if (e->flag == SC_SS_UNSELECT) {
+                fputc(']', out);
+                if (numdbytes > 16) {
+                    fputs("\r\n", out);
+                    numdbytes = 0;
+                }
+            }
+            else {
+                fprintf(out, "%02X%02X", e->master, e->slave);
+                ++numdbytes;
+            }
+        }
+    }
+    for (; d < numdamage; ++d) fwrite(damage_text + damage[d].start, 1, damage[d].len, out);
+    fclose(out);
+}
+
+void show_loop_model(void) {
+    int byte_loop = loop_pieces[LP_READY].cycles + loop_pieces[LP_DATA].cycles
+                    + loop_pieces[LP_SS].cycles + loop_pieces[LP_TIMER].cycles;
+    printf("capture loop at %d Mhz: a byte can come every %d cycles and must be read within %d\n",
+           CPU_HZ / 1000000, BYTE_CYCLES, IDLE_CYCLES);
+    for (int i = 0; i < LP_NUM; ++i) printf("  %-16s %3d cycles\n", loop_pieces[i].name, loop_pieces[i].cycles);
+    printf("a byte takes %d cycles around the loop, or %d with CYCLE_TIMES, %d more\n",
+           byte_loop, byte_loop + loop_pieces[LP_CYCLES].cycles, loop_pieces[LP_CYCLES].cycles);
+    printf("the bytes are placed %d cycles apart, so the files give only the order of the events\n\n", BYTE_CYCLES);
+    printf("%-32s %-11s %8s %7s %7s %5s %6s %6s %6s\n",
+           "file", "timing", "bytes", "latency", "slack", "loop", "late", "order", "missed");
+}
+
+bool model_capture_loop(const char *filename) {  // false if the loop couldn't keep up
+    bool ok = true;
+    FILE *datfile;
+    if ((datfile = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "can't open %s\n", filename);
+        return true;
+    }
+    read_file(datfile);
+    fclose(datfile);
+    make_bus_events();
+    if (bus_len == 0) {
+        printf("%-32s no events\n", filename);
+        return true;
+    }
+    for (int cycle_times = 0; cycle_times <= 1; ++cycle_times) {
+        struct loop_results r;
+        bool kept_up;
+        run_loop_model(cycle_times, &r);
+        kept_up = r.late + r.misordered + r.missed == 0 && r.worst_loop <= BYTE_CYCLES;
+        printf("%-32s %-11s %8llu %7lld %7lld %5d %6llu %6llu %6llu  %s\n",
+               filename, cycle_times ? "CYCLE_TIMES" : "micros()", r.bytes, r.worst_latency,
+               IDLE_CYCLES - r.worst_latency, r.worst_loop, r.late, r.misordered, r.missed,
+               kept_up ? "ok" : "TOO SLOW");
+        if (!kept_up) ok = false;
+    }
+    write_cycles_file(filename);
+    return ok;
+}
+
+//**************  replay files through pseudo-terminals  ***************
+
+/* Each file is sent a line at a time, when the time stamps in it say the
+Sniffer would have sent that line, divided by the speed. Long gaps, like the
+one at the start of a capture, are cut to REPLAY_MAX_GAP_USEC. We keep the
+other end of each terminal open too, so we can set it to raw mode and wait at
+the end until spi_decode has read everything. */
+
+#define REPLAY_MAX_GAP_USEC 1000000
+#define REPLAY_START_USEC 2000000  // time to start spi_decode -w on the terminals
+#define REPLAY_DRAIN_USEC 5000000  // how long to wait for the rest to be read
+
+#ifndef _WIN32
+struct replay {
+    const char *filename;
+    FILE *datfile;
+    int master, slave;
+    char *line;
+    size_t linesize;
+    ssize_t linelen;            // -1 at the end of the file
+    unsigned long long due;     // when to send the line, in usec from the start
+};
+
+unsigned long long replay_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void replay_sleep(unsigned long long usec) {
+    struct timespec ts = { (time_t)(usec / 1000000), (long)(usec % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+void replay_next_line(struct replay *r, double speed) {  // and when it is due
+    unsigned long long usec = 0;
+    if ((r->linelen = getline(&r->line, &r->linesize, r->datfile)) < 0) return;
+    for (char *p = r->line; (p = strchr(p, 't')) != NULL; ) {  // add up the time stamps
+        unsigned long long gap = strtoull(++p, &p, 10);
+        usec += gap < REPLAY_MAX_GAP_USEC ? gap : REPLAY_MAX_GAP_USEC;
+    }
+    r->due += (unsigned long long)(usec / speed);
+}
+
+void replay_files(int count, char *filenames[], double speed) {
+    struct replay *replays = calloc(count, sizeof(struct replay));
+    unsigned long long start;
+    int playing = 0;
+    if (replays == NULL) fatal_err("out of memory");
+    for (int i = 0; i < count; ++i) {
+        struct replay *r = &replays[i];
+        struct termios tio;
+        r->filename = filenames[i];
+        if ((r->datfile = fopen(r->filename, "r")) == NULL) {
+            fprintf(stderr, "can't open %s\n", r->filename);
+            exit(1);
+        }
+        if ((r->master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+                || grantpt(r->master) != 0 || unlockpt(r->master) != 0
+                || (r->slave = open(ptsname(r->master), O_RDWR | O_NOCTTY)) < 0)
+            fatal_err("can't create a pseudo-terminal");
+        tcgetattr(r->slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(r->slave, TCSANOW, &tio);
+        printf("%-32s %s\n", r->filename, ptsname(r->master));
+        r->due = REPLAY_START_USEC;
+        replay_next_line(r, speed);
+        if (r->linelen >= 0) ++playing;
+    }
+    printf("spi_decode -w");
+    for (int i = 0; i < count; ++i) printf(" %s", ptsname(replays[i].master));
+    printf("\n");
+    fflush(stdout);
+
+    start = replay_usec();
+    while (playing > 0) {  // send the line that is due first
+        struct replay *r = NULL;
+        unsigned long long now;
+        for (int i = 0; i < count; ++i)
+            if (replays[i].linelen >= 0 && (r == NULL || replays[i].due < r->due)) r = &replays[i];
+        if ((now = replay_usec() - start) < r->due) replay_sleep(r->due - now);
+        for (ssize_t sent = 0, n; sent < r->linelen; sent += n)
+            if ((n = write(r->master, r->line + sent, r->linelen - sent)) < 0) fatal_err("can't write to a pseudo-terminal");
+        replay_next_line(r, speed);
+        if (r->linelen < 0) --playing;
+    }
+
+    for (int i = 0; i < count; ++i) {  // let spi_decode read the rest, and then hang up
+        struct replay *r = &replays[i];
+        int unread;
+        for (unsigned long long waited = 0;
+                waited < REPLAY_DRAIN_USEC && ioctl(r->slave, FIONREAD, &unread) == 0 && unread > 0;
+                waited += 10000)
+            replay_sleep(10000);
+        close(r->slave);
+        close(r->master);
+        fclose(r->datfile);
+        free(r->line);
+    }
+    free(replays);
+    printf("replayed %d files in %.1f seconds\n", count, (replay_usec() - start) / 1e6);
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Model the Sniffer firmware's output compression on recorded traces\n");
+        fprintf(stderr, "Usage: spi_sniffer_model file.dat [file.dat...]\n");
+        fprintf(stderr, "       spi_sniffer_model -r[speed] file.dat [file.dat...]\n");
+        fprintf(stderr, "       spi_sniffer_model -c file.dat [file.dat...]\n");
+        fprintf(stderr, "  -r   replay the files in real time through pseudo-terminals, for spi_decode -w\n");
+        fprintf(stderr, "  -c   model the capture loop's cycle budget, with and without CYCLE_TIMES\n");
+        exit(1);
+    }
+    if (strcmp(argv[1], "-c") == 0) {
+        bool ok = true;
+        show_loop_model();
+        for (int i = 2; i < argc; ++i) if (!model_capture_loop(argv[i])) ok = false;
+        return ok ? 0 : 2;
+    }
+    if (argv[1][0] == '-' && argv[1][1] == 'r') {
+#ifndef _WIN32
+        double speed = argv[1][2] ? atof(&argv[1][2]) : 1.0;
+        if (speed <= 0 || argc < 3) fatal_err("replaying needs a speed above 0 and files");
+        replay_files(argc - 2, &argv[2], speed);
+        return 0;
+#else
+        fatal_err("replaying through pseudo-terminals needs Linux");
+#endif
+    }
+    printf("%-32s %8s %9s %9s %5s %7s %7s %7s %7s\n",
+           "file", "events", "plain", "compr", "ratio", "runs", "repeats", "ns/evt", "cyc/evt");
+    for (int i = 1; i < argc; ++i) model_file(argv[i]);
+    if (total.events > 0)
+        printf("%-32s %8llu %9llu %9llu %5.2f %7s %7s %7.1f %7.1f\n", "total",
+               total.events, total.plain, total.compressed, (double)total.plain / total.compressed,
+               "", "", total.seconds * 1e9 / total.events, total.cycles / total.events);
+    return 0;
+}